@@ -0,0 +1,109 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <base/allocator.h>
+#include <util/noncopyable.h>
+
+namespace Snapper
+{
+  class Arena;
+}
+
+/**
+ * @brief Bump allocator which carves allocations out of large chunks
+ * taken from a backing allocator. Freed blocks are kept in per-size
+ * free lists and reused by later allocations of the same size. All
+ * chunks are returned to the backing allocator at once, either by
+ * release() or by the destructor.
+ */
+class Snapper::Arena : Genode::Noncopyable
+{
+private:
+  struct Chunk
+  {
+    Chunk *next;
+    Genode::size_t size;
+  };
+
+  struct Free_block
+  {
+    Free_block *next;
+  };
+
+  struct Size_class
+  {
+    Genode::size_t size;
+    Free_block *head;
+  };
+
+  enum
+  {
+    CHUNK_SIZE = 64 * 1024,
+    ALIGN = sizeof (Genode::addr_t),
+    MAX_SIZE_CLASSES = 8,
+  };
+
+  Genode::Allocator &_backing;
+
+  Chunk *_chunks = nullptr;
+  char *_pos = nullptr;
+  Genode::size_t _left = 0;
+
+  Size_class _classes[MAX_SIZE_CLASSES]{};
+
+  Genode::size_t _consumed = 0;
+  Genode::size_t _in_use = 0;
+
+  static Genode::size_t
+  _align (Genode::size_t size)
+  {
+    return (size + ALIGN - 1) & ~(Genode::size_t)(ALIGN - 1);
+  }
+
+  Size_class *_size_class (Genode::size_t size, bool create);
+
+  char *_new_chunk (Genode::size_t size);
+
+public:
+  Arena (Genode::Allocator &backing) : _backing (backing) {}
+  ~Arena () { release (); }
+
+  /**
+   * @throws Genode::Out_of_ram
+   * @throws Genode::Out_of_caps
+   */
+  void *alloc (Genode::size_t size);
+
+  /**
+   * @brief Hands the block back for reuse by allocations of the same
+   * size. The memory is only returned to the backing allocator by
+   * release().
+   */
+  void free (void *addr, Genode::size_t size);
+
+  /**
+   * @brief Returns all chunks to the backing allocator, invalidating
+   * every allocation of the arena.
+   */
+  void release (void);
+
+  /**
+   * @brief Number of bytes taken from the backing allocator.
+   */
+  Genode::size_t
+  consumed (void) const
+  {
+    return _consumed;
+  }
+
+  /**
+   * @brief Number of bytes handed out by alloc() and not freed yet.
+   */
+  Genode::size_t
+  in_use (void) const
+  {
+    return _in_use;
+  }
+};
+
+#endif // __ARENA_H
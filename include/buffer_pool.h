@@ -0,0 +1,89 @@
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include <base/allocator.h>
+#include <util/noncopyable.h>
+#include <util/string.h>
+
+namespace Snapper
+{
+  class Buffer_pool;
+}
+
+/**
+ * @brief A few I/O buffers of a fixed size, which are allocated once
+ * and borrowed by the code paths that read or write snapshot and
+ * archive files, instead of allocating a buffer per call.
+ *
+ * Requests larger than the buffers, or made while all buffers are
+ * borrowed, fall back to an allocation for the call. Must only be
+ * used from the entrypoint.
+ */
+class Snapper::Buffer_pool : Genode::Noncopyable
+{
+public:
+  enum
+  {
+    BUFFERS = 2
+  };
+
+private:
+  Genode::Allocator &_alloc;
+  Genode::size_t const _size;
+
+  char *_buffers[BUFFERS]{};
+  bool _borrowed[BUFFERS]{};
+
+  /**
+   * @brief Returns a buffer of at least the given size, and whether it
+   * belongs to the pool.
+   */
+  char *_borrow (Genode::size_t, bool &pooled);
+
+  void _release (char *, Genode::size_t, bool pooled);
+
+public:
+  /**
+   * @throws Genode::Out_of_ram
+   * @throws Genode::Out_of_caps
+   */
+  Buffer_pool (Genode::Allocator &, Genode::size_t size);
+  ~Buffer_pool ();
+
+  /**
+   * @brief Calls fn() with a Byte_range_ptr of the given size, which
+   *        must not be used once fn() returns.
+   * @throws Genode::Out_of_ram if the buffer cannot be borrowed
+   * @throws Genode::Out_of_caps if the buffer cannot be borrowed
+   */
+  template <typename FN>
+  void
+  with_buffer (Genode::size_t size, FN const &fn)
+  {
+    struct Borrowed
+    {
+      Buffer_pool &pool;
+      Genode::size_t size;
+      bool pooled = false;
+      char *start = nullptr;
+
+      Borrowed (Buffer_pool &pool, Genode::size_t size)
+          : pool (pool), size (size), start (pool._borrow (size, pooled))
+      {
+      }
+
+      ~Borrowed () { pool._release (start, size, pooled); }
+    } borrowed (*this, size);
+
+    Genode::Byte_range_ptr buf (borrowed.start, size);
+    fn (buf);
+  }
+
+  Genode::size_t
+  buffer_size (void) const
+  {
+    return _size;
+  }
+};
+
+#endif // __BUFFER_POOL_H
@@ -0,0 +1,304 @@
+#ifndef __FLAT_DICTIONARY_H
+#define __FLAT_DICTIONARY_H
+
+#include <base/allocator.h>
+#include <util/construct_at.h>
+#include <util/noncopyable.h>
+#include <util/string.h>
+
+namespace Snapper
+{
+  template <typename T, typename KEY> class FlatDictionary;
+}
+
+/**
+ * @brief Dictionary that keeps its keys and elements in two sorted
+ * arrays. Lookups binary-search the dense key array instead of chasing
+ * tree nodes. Mirrors the interface of Genode::Dictionary, except that
+ * elements are constructed by the dictionary itself (see insert()).
+ *
+ * Elements are relocated with memmove() when the arrays grow or
+ * shrink, hence T must not point into itself and references to
+ * elements are invalidated by insert() and remove().
+ */
+template <typename T, typename KEY>
+class Snapper::FlatDictionary : Genode::Noncopyable
+{
+private:
+  Genode::Allocator &_alloc;
+
+  KEY *_keys = nullptr;
+  T *_elements = nullptr;
+
+  Genode::size_t _count = 0;
+  Genode::size_t _capacity = 0;
+
+  enum
+  {
+    INITIAL_CAPACITY = 64
+  };
+
+  /**
+   * @brief Returns the position of the first key that is not lower
+   * than the key.
+   */
+  Genode::size_t
+  _lower_bound (KEY const &key) const
+  {
+    // INFO Keys are mostly inserted in ascending order (e.g. when
+    // reading an archive file), which makes appending the common case.
+    if (_count && _keys[_count - 1] < key)
+      return _count;
+
+    Genode::size_t lo = 0;
+    Genode::size_t hi = _count;
+
+    while (lo < hi)
+      {
+        Genode::size_t mid = lo + (hi - lo) / 2;
+
+        if (_keys[mid] < key)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+    return lo;
+  }
+
+  bool
+  _find (KEY const &key, Genode::size_t &pos) const
+  {
+    pos = _lower_bound (key);
+    return pos < _count && !(key < _keys[pos]);
+  }
+
+  void
+  _free (void)
+  {
+    if (_keys)
+      _alloc.free (_keys, _capacity * sizeof (KEY));
+
+    if (_elements)
+      _alloc.free (_elements, _capacity * sizeof (T));
+
+    _keys = nullptr;
+    _elements = nullptr;
+    _capacity = 0;
+  }
+
+  void
+  _grow (Genode::size_t capacity)
+  {
+    KEY *keys = (KEY *)_alloc.alloc (capacity * sizeof (KEY));
+    T *elements = (T *)_alloc.alloc (capacity * sizeof (T));
+
+    if (_count)
+      {
+        Genode::memcpy (keys, _keys, _count * sizeof (KEY));
+        Genode::memcpy ((void *)elements, (void *)_elements,
+                        _count * sizeof (T));
+      }
+
+    Genode::size_t count = _count;
+    _free ();
+
+    _keys = keys;
+    _elements = elements;
+    _count = count;
+    _capacity = capacity;
+  }
+
+public:
+  FlatDictionary (Genode::Allocator &alloc) : _alloc (alloc) {}
+
+  ~FlatDictionary ()
+  {
+    clear ();
+    _free ();
+  }
+
+  /**
+   * @brief Allocates room for at least `capacity` elements.
+   */
+  void
+  reserve (Genode::size_t capacity)
+  {
+    if (capacity > _capacity)
+      _grow (capacity);
+  }
+
+  /**
+   * @brief Constructs a new element for the key, which must not be
+   * present in the dictionary yet.
+   */
+  template <typename... ARGS>
+  T &
+  insert (KEY const &key, ARGS &&...args)
+  {
+    Genode::size_t pos = _lower_bound (key);
+
+    if (_count == _capacity)
+      _grow (_capacity ? _capacity * 2 : INITIAL_CAPACITY);
+
+    if (pos < _count)
+      {
+        Genode::memmove (_keys + pos + 1, _keys + pos,
+                         (_count - pos) * sizeof (KEY));
+
+        Genode::memmove ((void *)(_elements + pos + 1),
+                         (void *)(_elements + pos),
+                         (_count - pos) * sizeof (T));
+      }
+
+    _keys[pos] = key;
+    Genode::construct_at<T> (_elements + pos, args...);
+    _count++;
+
+    return _elements[pos];
+  }
+
+  /**
+   * @brief Destroys the element of the key. Returns false if the key is
+   * not present.
+   */
+  bool
+  remove (KEY const &key)
+  {
+    Genode::size_t pos;
+    if (!_find (key, pos))
+      return false;
+
+    _elements[pos].~T ();
+
+    if (pos + 1 < _count)
+      {
+        Genode::memmove (_keys + pos, _keys + pos + 1,
+                         (_count - pos - 1) * sizeof (KEY));
+
+        Genode::memmove ((void *)(_elements + pos),
+                         (void *)(_elements + pos + 1),
+                         (_count - pos - 1) * sizeof (T));
+      }
+
+    _count--;
+    return true;
+  }
+
+  /**
+   * @brief Destroys each element for which fn() returns true, keeping
+   * the order of the remaining ones. Compacts the arrays in a single
+   * pass. Returns the number of removed elements.
+   */
+  template <typename FN>
+  Genode::size_t
+  remove_if (FN const &fn)
+  {
+    Genode::size_t kept = 0;
+
+    for (Genode::size_t i = 0; i < _count; i++)
+      {
+        if (fn (static_cast<T const &> (_elements[i])))
+          {
+            _elements[i].~T ();
+            continue;
+          }
+
+        if (kept != i)
+          {
+            _keys[kept] = _keys[i];
+            Genode::memmove ((void *)(_elements + kept),
+                             (void *)(_elements + i), sizeof (T));
+          }
+
+        kept++;
+      }
+
+    Genode::size_t removed = _count - kept;
+    _count = kept;
+
+    return removed;
+  }
+
+  /**
+   * @brief Destroys all elements.
+   */
+  void
+  clear (void)
+  {
+    for (Genode::size_t i = 0; i < _count; i++)
+      _elements[i].~T ();
+
+    _count = 0;
+  }
+
+  template <typename MATCH_FN, typename NO_MATCH_FN>
+  void
+  with_element (KEY const &key, MATCH_FN const &match_fn,
+                NO_MATCH_FN const &no_match_fn)
+  {
+    Genode::size_t pos;
+    if (_find (key, pos))
+      match_fn (_elements[pos]);
+    else
+      no_match_fn ();
+  }
+
+  template <typename FN>
+  bool
+  with_any_element (FN const &fn)
+  {
+    if (!_count)
+      return false;
+
+    fn (_elements[0]);
+    return true;
+  }
+
+  /**
+   * @brief Calls fn() for each element in ascending key order.
+   */
+  template <typename FN>
+  void
+  for_each (FN const &fn) const
+  {
+    for (Genode::size_t i = 0; i < _count; i++)
+      fn (static_cast<T const &> (_elements[i]));
+  }
+
+  template <typename FN>
+  void
+  for_each (FN const &fn)
+  {
+    for (Genode::size_t i = 0; i < _count; i++)
+      fn (_elements[i]);
+  }
+
+  /**
+   * @brief Calls fn() for each element whose key lies within
+   * [first, last], in ascending key order.
+   */
+  template <typename FN>
+  void
+  for_each_in_range (KEY const &first, KEY const &last, FN const &fn)
+  {
+    for (Genode::size_t i = _lower_bound (first);
+         i < _count && !(last < _keys[i]); i++)
+      fn (_elements[i]);
+  }
+
+  bool
+  exists (KEY const &key) const
+  {
+    Genode::size_t pos;
+    return _find (key, pos);
+  }
+
+  Genode::size_t
+  count (void) const
+  {
+    return _count;
+  }
+};
+
+#endif // __FLAT_DICTIONARY_H
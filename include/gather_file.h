@@ -0,0 +1,41 @@
+#ifndef __GATHER_FILE_H
+#define __GATHER_FILE_H
+
+#include <os/vfs.h>
+
+namespace Snapper
+{
+  /**
+   * @brief A byte range of a gather list.
+   */
+  struct Gather_range
+  {
+    void const *start;
+    Genode::size_t num_bytes;
+  };
+
+  /**
+   * @brief Appends the ranges to the file one after the other, so a
+   * header and its payload are written without assembling them in a
+   * buffer first. FILE is a Genode::New_file or a Genode::Append_file.
+   * Returns false if an append failed.
+   *
+   * Files made of many small records, the archive and spill files, are
+   * not written this way but streamed through a Chunk_writer of a fixed
+   * size (see archive.cc), as one append per record would be too slow.
+   */
+  template <typename FILE, Genode::size_t N>
+  bool
+  append_gather (FILE &file, Gather_range const (&ranges)[N])
+  {
+    for (Gather_range const &range : ranges)
+      if (range.num_bytes
+          && file.append ((char const *)range.start, range.num_bytes)
+                 != Genode::New_file::Append_result::OK)
+        return false;
+
+    return true;
+  }
+}
+
+#endif // __GATHER_FILE_H
@@ -0,0 +1,105 @@
+#ifndef __HASH_ENGINE_H
+#define __HASH_ENGINE_H
+
+#include <base/stdint.h>
+
+#include "tree_hash.h"
+#include "xxhash32.h"
+
+namespace Snapper
+{
+  class Hasher;
+
+  /**
+   * @brief The hash of a snapshot file, stored in the high nibble of
+   * its version byte. Files written before hash ids existed have id 0.
+   */
+  enum Hash_id
+  {
+    Xxh32 = 0,
+    Tree_xxh32 = 1,
+    Crc32c = 2,
+  };
+
+  /**
+   * @brief CRC32C (Castagnoli) of the data. Uses the SSE4.2 crc32
+   * instruction if the CPU supports it, a lookup table otherwise.
+   */
+  Genode::uint32_t crc32c (const void *, Genode::uint64_t);
+
+  /**
+   * @brief Continues the CRC32C of preceding data. The state starts
+   * at ~0 and the CRC32C is the inverted final state.
+   */
+  Genode::uint32_t crc32c_update (Genode::uint32_t, const void *,
+                                  Genode::uint64_t);
+
+  /**
+   * @brief Hashes the data with the given hash, on the calling thread.
+   */
+  Genode::uint32_t hash_data (Hash_id, const void *, Genode::uint64_t);
+
+  enum
+  {
+    FUSED_BLOCK = 8 * 1024
+  };
+
+  /**
+   * @brief Copies the data to the destination and returns its hash.
+   * Each block of FUSED_BLOCK bytes is hashed right after it was
+   * copied, while it is still cached, hence the data is read from
+   * memory only once.
+   */
+  Genode::uint32_t copy_and_hash (Hash_id, void *, const void *,
+                                  Genode::uint64_t);
+}
+
+/**
+ * @brief Hashes data with any of the hashes as it is streamed.
+ * Mirrors the interface of XXHash32.
+ */
+class Snapper::Hasher
+{
+private:
+  Hash_id _id;
+
+  XXHash32 _xxh32{ 0 };
+  Tree_hasher _tree{};
+  Genode::uint32_t _crc = ~0U;
+
+public:
+  Hasher (Hash_id id) : _id (id) {}
+
+  void
+  add (const void *input, Genode::uint64_t length)
+  {
+    switch (_id)
+      {
+      case Tree_xxh32:
+        _tree.add (input, length);
+        break;
+      case Crc32c:
+        _crc = crc32c_update (_crc, input, length);
+        break;
+      default:
+        _xxh32.add (input, length);
+        break;
+      }
+  }
+
+  Genode::uint32_t
+  hash (void)
+  {
+    switch (_id)
+      {
+      case Tree_xxh32:
+        return _tree.hash ();
+      case Crc32c:
+        return ~_crc;
+      default:
+        return _xxh32.hash ();
+      }
+  }
+};
+
+#endif // __HASH_ENGINE_H
@@ -4,18 +4,27 @@
 #ifdef __cplusplus
 #include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
+#include <base/signal.h>
 #include <os/path.h>
 #include <os/vfs.h>
 #include <root/component.h>
 #include <rtc_session/connection.h>
 #include <timer_session/connection.h>
 #include <util/attempt.h>
-#include <util/dictionary.h>
-#include <util/fifo.h>
 #include <util/noncopyable.h>
 #include <vfs/simple_env.h>
 #include <vfs/types.h>
 
+#include "arena.h"
+#include "buffer_pool.h"
+#include "flat_dictionary.h"
+#include "gather_file.h"
+#include "hash_engine.h"
+#include "tree_hash.h"
+#include "vfs_writer.h"
+#include "worker_pool.h"
+#include "xxhash32.h"
+
 namespace Snapper
 {
   class Main;
@@ -31,6 +40,60 @@ namespace Snapper
     Version = 2
   };
 
+  /**
+   * INFO The low nibble of the version byte of a snapshot file holds
+   * the format version, the high nibble its Hash_id.
+   */
+  inline VERSION
+  version_byte (Hash_id id)
+  {
+    return (VERSION)(Version | (id << 4));
+  }
+
+  inline unsigned
+  format_version (VERSION version)
+  {
+    return version & 0xf;
+  }
+
+  inline Hash_id
+  hash_id (VERSION version)
+  {
+    return (Hash_id)(version >> 4);
+  }
+
+  /**
+   * @brief Hashes the data with the hash of the version byte.
+   */
+  inline HASH
+  payload_hash (VERSION version, const void *data, Genode::uint64_t size)
+  {
+    return hash_data (hash_id (version), data, size);
+  }
+
+  /**
+   * @brief The VERSION|HASH|RC header of a snapshot file, in its
+   *        on-disk layout. The payload follows it.
+   */
+  struct Snapshot_header
+  {
+    enum
+    {
+      SIZE = sizeof (VERSION) + sizeof (HASH) + sizeof (RC)
+    };
+
+    char bytes[SIZE];
+
+    Snapshot_header (VERSION version = Version, HASH hash = 0,
+                     RC reference_count = 1)
+    {
+      Genode::memcpy (bytes, &version, sizeof (VERSION));
+      Genode::memcpy (bytes + sizeof (VERSION), &hash, sizeof (HASH));
+      Genode::memcpy (bytes + sizeof (VERSION) + sizeof (HASH),
+                      &reference_count, sizeof (RC));
+    }
+  };
+
   enum State
   {
     Dormant,
@@ -52,6 +115,8 @@ namespace Snapper
     NoData,
     RestoreFailed,
     PurgeDenied,
+    PayloadNeeded,
+    WriteFailed,
   };
 
   enum CrashStates
@@ -82,6 +147,43 @@ namespace Snapper
    *                          possible.
    * @field expiration		  	How many seconds a generation should
    *                          be kept.
+   * @field checkpoint		  	The maximum number of consecutive
+   *                          delta generations before a full archive
+   *                          is written again. 0 disables delta
+   *                          archives.
+   * @field index_stride	  	Every n-th key of an opened generation's
+   *                          archive is kept in memory for looking up
+   *                          keys during restoration.
+   * @field archive_budget  	The number of bytes the backlinks of
+   *                          the archive may occupy in memory. Above
+   *                          it, the least recently used partitions
+   *                          are spilled to disk. 0 disables the
+   *                          limit.
+   * @field workers		  	The number of threads which hash the
+   *                          payloads of batched snapshots in
+   *                          parallel to the entrypoint.
+   * @field write_behind  	The number of bytes of payloads which
+   *                          are acknowledged before their snapshot
+   *                          files are written. 0 writes them
+   *                          immediately.
+   * @field read_ahead    	The number of bytes of payloads which
+   *                          can be prefetched from an opened
+   *                          generation. 0 disables prefetching.
+   * @field tree_threshold	Payloads of at least this size are
+   *                          hashed with the tree hash, whose leaves
+   *                          are hashed by the worker threads. 0
+   *                          disables the tree hash.
+   * @field hash            	The hash of new snapshot files, either
+   *                          Xxh32 or Crc32c. Crc32c is faster where
+   *                          the CPU implements it, but is only meant
+   *                          for integrity checks, so its snapshot
+   *                          files are not reused for identical
+   *                          payloads. The tree hash only applies to
+   *                          Xxh32.
+   * @field queue_bufsize 	The size of the bulk buffer of a
+   *                          session's asynchronous snapshot queue.
+   *                          Allocated once the client uses the
+   *                          queue.
    */
   struct Config
   {
@@ -94,7 +196,15 @@ namespace Snapper
       _max_snapshots = 0,
       _min_snapshots = 0,
       _expiration = 0,
+      _checkpoint = 0,
+      _index_stride = 64,
+      _archive_budget = 0,
+      _workers = 0,
+      _write_behind = 0,
+      _read_ahead = 0,
+      _tree_threshold = 0,
       _bufsize = 1024 * 1024,
+      _queue_bufsize = 128 * 1024,
     };
 
     bool verbose = _verbose;
@@ -104,7 +214,16 @@ namespace Snapper
     Genode::uint64_t max_snapshots = _max_snapshots;
     Genode::uint64_t min_snapshots = _min_snapshots;
     Genode::uint64_t expiration = _expiration;
+    Genode::uint64_t checkpoint = _checkpoint;
+    Genode::uint64_t index_stride = _index_stride;
+    Genode::Number_of_bytes archive_budget = _archive_budget;
+    unsigned workers = _workers;
+    Genode::Number_of_bytes write_behind = _write_behind;
+    Genode::Number_of_bytes read_ahead = _read_ahead;
+    Genode::Number_of_bytes tree_threshold = _tree_threshold;
+    Hash_id hash = Xxh32;
     Genode::Number_of_bytes bufsize = _bufsize;
+    Genode::Number_of_bytes queue_bufsize = _queue_bufsize;
   };
 
   /**
@@ -115,21 +234,17 @@ namespace Snapper
   {
     typedef Genode::uint64_t ArchiveKey;
     struct Backlink;
+    struct Queue;
     struct ArchiveEntry;
-    typedef Genode::Fifo<Backlink> Queue;
-    typedef Genode::Dictionary<ArchiveEntry, ArchiveKey> ArchiveContainer;
+    typedef FlatDictionary<ArchiveEntry, ArchiveKey> ArchiveContainer;
 
     /**
      * @brief Represents a redundant snapshot file.
      */
-    struct Backlink : Genode::Fifo<Backlink>::Element
+    struct Backlink
     {
       Genode::String<Vfs::MAX_PATH_LEN> value;
 
-      // INFO The backlink is allocated by the Archive's allocator,
-      // hence we need to store the pointer somewhere for later deallocation.
-      Backlink *_self;
-
       Genode::Heap &heap;
       Genode::Directory &snapper_root;
       bool verbose;
@@ -137,8 +252,8 @@ namespace Snapper
       Backlink () = delete;
       Backlink (Genode::Heap &heap, Genode::Directory &snapper_root,
                 bool verbose, const Genode::String<Vfs::MAX_PATH_LEN> &value)
-          : value (value), _self (nullptr), heap (heap),
-            snapper_root (snapper_root), verbose (verbose)
+          : value (value), heap (heap), snapper_root (snapper_root),
+            verbose (verbose)
       {
       }
 
@@ -181,28 +296,150 @@ namespace Snapper
       Error get_data (Genode::Byte_range_ptr &);
 
       /**
-       * @brief Update the reference count of the backlink.
+       * @brief Get the given range of the data stored in the backlink,
+       * starting at the offset. The data is not checked against the
+       * hash, see verify_data().
+       */
+      Error get_data_range (Genode::Byte_range_ptr &, Genode::size_t);
+
+      /**
+       * @brief Checks the version and the data against the hash of the
+       * backlink. The data is hashed in chunks of VERIFY_CHUNK bytes,
+       * read into a buffer borrowed from the pool.
+       */
+      Error verify_data (Buffer_pool &);
+
+      enum
+      {
+        VERIFY_CHUNK = 64 * 1024
+      };
+
+      /**
+       * @brief Update the reference count of the backlink. Only the
+       * reference count is overwritten, in place. Blocks until the
+       * writer wrote it, hence the writer must not be used otherwise.
        */
       Genode::Attempt<Snapper::RC, Error>
-      set_reference_count (const Snapper::RC);
+      write_reference_count (const Snapper::RC, Vfs_writer &);
 
       /**
-       * @brief Checks if the backlink's version and CRC are valid.
+       * @brief Checks if the backlink's version and CRC are valid. The
+       * hash id of the version byte must match as well.
        */
-      bool is_backlink_valid (Snapper::HASH);
+      bool is_backlink_valid (Snapper::HASH, Snapper::VERSION = Version);
+    };
+
+    /**
+     * @brief The backlinks of an ArchiveEntry, stored contiguously in
+     * the order they were enqueued. Mirrors the interface of
+     * Genode::Fifo, except that backlinks are constructed in place.
+     */
+    struct Queue : Genode::Noncopyable
+    {
+      Arena &alloc;
+
+      Backlink *slots = nullptr;
+      Genode::uint32_t count = 0;
+      Genode::uint32_t capacity = 0;
+
+      Queue (Arena &alloc) : alloc (alloc) {}
+      ~Queue ();
+
+      bool
+      empty (void) const
+      {
+        return count == 0;
+      }
+
+      template <typename... ARGS>
+      Backlink &
+      enqueue (ARGS &&...args)
+      {
+        if (count == capacity)
+          _grow ();
+
+        Genode::construct_at<Backlink> (slots + count, args...);
+        return slots[count++];
+      }
+
+      template <typename FN>
+      void
+      for_each (FN const &fn) const
+      {
+        for (Genode::uint32_t i = 0; i < count; i++)
+          fn (slots[i]);
+      }
+
+      /**
+       * @brief Removes each backlink for which fn() returns true,
+       *        keeping the order of the remaining ones. Returns the
+       *        number of removed backlinks.
+       */
+      template <typename FN>
+      Genode::uint32_t
+      remove_if (FN const &fn)
+      {
+        Genode::uint32_t kept = 0;
+
+        for (Genode::uint32_t i = 0; i < count; i++)
+          {
+            if (fn (slots[i]))
+              {
+                slots[i].~Backlink ();
+                continue;
+              }
+
+            if (kept != i)
+              {
+                Genode::construct_at<Backlink> (slots + kept, slots[i]);
+                slots[i].~Backlink ();
+              }
+
+            kept++;
+          }
+
+        Genode::uint32_t removed = count - kept;
+        count = kept;
+
+        return removed;
+      }
+
+    private:
+      void _grow (void);
     };
 
     /**
      * @brief Identifies which Backlinks belong to which ArchiveKey.
      */
-    struct ArchiveEntry : Genode::Dictionary<ArchiveEntry, ArchiveKey>::Element
+    struct ArchiveEntry : Genode::Noncopyable
     {
+      const ArchiveKey name;
       Queue queue;
-      ArchiveEntry *_self;
 
-      ArchiveEntry (ArchiveKey id,
-                    Genode::Dictionary<ArchiveEntry, ArchiveKey> &archive)
-          : Element (archive, id), queue (), _self (nullptr)
+      /**
+       * @brief The archive epoch in which the backlinks of this entry
+       * were last changed (see Archive::epoch).
+       */
+      Genode::uint64_t epoch;
+
+      /**
+       * @brief The archive epoch in which the key was last submitted.
+       * Keys not submitted during a snapshot are carried forward when
+       * it is committed (see Main::commit_snapshot()).
+       */
+      Genode::uint64_t submitted;
+
+      /**
+       * @brief The archive epoch in which the reference count of a
+       * backlink of an earlier generation was last raised, and by how
+       * much (see Archive::link()).
+       */
+      Genode::uint64_t linked;
+      Genode::uint32_t links;
+
+      ArchiveEntry (ArchiveKey id, Arena &alloc, Genode::uint64_t epoch)
+          : name (id), queue (alloc), epoch (epoch), submitted (epoch),
+            linked (epoch), links (0)
       {
       }
 
@@ -210,17 +447,164 @@ namespace Snapper
       bool operator= (const ArchiveEntry &) = delete;
     };
 
+    /**
+     * @brief Sparse index over the sorted key-value records of an
+     * archive (or delta) file. Looks up the backlinks of a single key
+     * by reading only the block of records that may contain it,
+     * instead of loading the entire file into an Archive.
+     */
+    struct Index : Genode::Noncopyable
+    {
+      Genode::Heap &heap;
+      Genode::Readonly_file file;
+      const bool delta;
+
+      /**
+       * @brief Every `stride`-th key of the file is kept in memory.
+       */
+      const Genode::uint64_t stride;
+
+      /**
+       * @brief The index of the generation a delta file is based on.
+       * Owned by this index and only attached once both are fully
+       * constructed (see Main::__index_gen()).
+       */
+      Index *parent = nullptr;
+
+      Genode::uint64_t num_records = 0;
+      Genode::size_t data_offset = 0;
+
+      ArchiveKey *keys = nullptr;
+      Genode::uint64_t num_keys = 0;
+
+      /**
+       * @brief The most recently read block of records.
+       */
+      char *block = nullptr;
+      Genode::uint64_t block_idx = ~0ULL;
+
+      static constexpr Genode::size_t KEY_SIZE = sizeof (ArchiveKey);
+      static constexpr Genode::size_t VAL_SIZE
+          = sizeof (decltype (Backlink::value));
+      static constexpr Genode::size_t RECORD_SIZE = KEY_SIZE + VAL_SIZE;
+
+      Index () = delete;
+
+      /**
+       * @brief Reads every `stride`-th key of the archive file.
+       * Rejects files too short for the number of records they claim.
+       * @throws Snapper::CrashStates
+       * @throws Genode::File::Open_failed
+       */
+      Index (Genode::Heap &, Genode::Directory &,
+             const Genode::String<Vfs::MAX_PATH_LEN> &, bool delta,
+             Genode::uint64_t stride);
+
+      ~Index ();
+
+      /**
+       * @brief Calls fn() for each backlink value of the key, in the
+       *        order they were committed. Returns false if the key is
+       *        not part of the generation.
+       * @throws Snapper::CrashStates
+       */
+      template <typename FN>
+      bool
+      with_backlinks (const ArchiveKey key, FN const &fn)
+      {
+        bool found = false;
+        bool removed = false;
+
+        for (Genode::uint64_t i = _lower_bound (key); i < num_records; i++)
+          {
+            ArchiveKey record_key;
+            const char *val = _record (i, record_key);
+
+            if (record_key < key)
+              continue;
+
+            if (record_key > key)
+              break;
+
+            found = true;
+
+            // INFO An empty value marks a key removed by a delta.
+            if (!*val)
+              {
+                removed = true;
+                continue;
+              }
+
+            fn (decltype (Backlink::value) (Genode::Cstring (val)));
+          }
+
+        if (found)
+          return !removed;
+
+        return parent ? parent->with_backlinks (key, fn) : false;
+      }
+
+    private:
+      /**
+       * @brief Returns the first record which may contain the key.
+       */
+      Genode::uint64_t _lower_bound (const ArchiveKey);
+
+      /**
+       * @brief Frees the keys, the block and the parent.
+       */
+      void _release (void);
+
+      /**
+       * @brief Returns the value of the i-th record and stores its key.
+       * @throws Snapper::CrashStates
+       */
+      const char *_record (Genode::uint64_t, ArchiveKey &);
+    };
+
     Archive () = delete;
 
+    /**
+     * @brief Consecutive keys are grouped into partitions, which are
+     * the unit of spilling backlinks to disk (see budget).
+     */
+    struct Partition : Genode::Noncopyable
+    {
+      const Genode::uint64_t name;
+
+      bool spilled = false;
+      Genode::size_t size = 0;
+
+      /**
+       * @brief Value of Archive::clock at the latest access.
+       */
+      Genode::uint64_t last_use = 0;
+
+      Partition (Genode::uint64_t id) : name (id) {}
+    };
+
+    enum
+    {
+      PARTITION_KEYS = 256,
+      IO_CHUNK = 64 * 1024,
+    };
+
     /**
      * @brief Constructs a new Archive to keep track of backlink
      * mappings.
      * @throws Genode::Create_failed
      */
-    Archive (Genode::Heap &, Genode::Directory &, bool);
+    Archive (Genode::Heap &, Genode::Directory &, bool,
+             Genode::size_t budget = 0);
 
     ~Archive ();
 
+    /**
+     * @brief Backs the backlink slots of all entries. Released in one
+     * go when the archive is destroyed.
+     */
+    Arena arena;
+
     ArchiveContainer archive;
 
     Genode::Heap &heap;
@@ -229,6 +613,74 @@ namespace Snapper
 
     Genode::uint64_t total_backlinks = 0;
 
+    /**
+     * @brief Entries whose backlinks changed during the current epoch
+     * are the ones written to a delta archive. The epoch advances
+     * every time the archive is sealed (see seal()).
+     */
+    Genode::uint64_t epoch = 0;
+
+    /**
+     * @brief The number of bytes the backlink slots may occupy. Above
+     * it, the least recently used partitions are written to a spill
+     * file under <snapper-root>/.spill and paged back on access. 0
+     * disables the limit.
+     */
+    Genode::size_t budget;
+
+    FlatDictionary<Partition, Genode::uint64_t> partitions;
+    Genode::uint64_t clock = 0;
+
+    /**
+     * @brief Set once spilling failed, after which the archive stays
+     * in memory regardless of the budget.
+     */
+    bool spill_failed = false;
+
+    /**
+     * @brief Distinguishes the spill files of archives that exist at
+     * the same time (e.g. while purging). Unique within a run, the
+     * first archive of a run removes the spill files of earlier runs.
+     */
+    const Genode::uint64_t spill_id;
+
+    /**
+     * @brief Calls match_fn() with the entry of the key, after paging
+     * its backlinks back in if they were spilled.
+     */
+    template <typename MATCH_FN, typename NO_MATCH_FN>
+    void
+    with_entry (const ArchiveKey key, MATCH_FN const &match_fn,
+                NO_MATCH_FN const &no_match_fn)
+    {
+      _make_resident (key);
+      archive.with_element (key, match_fn, no_match_fn);
+    }
+
+    /**
+     * @brief Calls fn() for each entry in ascending key order. Spilled
+     * partitions are paged in one after another, hence at most a few
+     * of them are held in memory at the same time.
+     */
+    template <typename FN>
+    void
+    for_each_entry (FN const &fn)
+    {
+      bool first = true;
+      Genode::uint64_t current = 0;
+
+      archive.for_each ([&] (const ArchiveEntry &entry) {
+        if (first || _partition (entry.name) != current)
+          {
+            _make_resident (entry.name);
+            current = _partition (entry.name);
+            first = false;
+          }
+
+        fn (entry);
+      });
+    }
+
     /**
      * @brief Inserts entry into the archive. If the key is already
      *        present the entry is prepended to a FIFO queue.
@@ -243,6 +695,46 @@ namespace Snapper
     void commit (Genode::Directory &,
                  const Genode::String<Vfs::MAX_PATH_LEN> & = "archive");
 
+    /**
+     * @brief Saves only the entries changed during the current epoch
+     * to a delta file in the specified directory. The delta file
+     * records the name of its parent generation, which the delta is
+     * applied on top of.
+     */
+    void commit_delta (
+        Genode::Directory &,
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN> &,
+        const Genode::String<Vfs::MAX_PATH_LEN> & = "delta");
+
+    /**
+     * @brief Marks the entry as changed in the current epoch.
+     */
+    void touch (ArchiveEntry &);
+
+    /**
+     * @brief Marks the entry as submitted in the current epoch.
+     */
+    void mark_submitted (ArchiveEntry &);
+
+    /**
+     * @brief Records that the current epoch raised the reference count
+     *        of a backlink of an earlier generation of the entry.
+     */
+    void link (ArchiveEntry &);
+
+    /**
+     * @brief Returns by how much the current epoch raised the reference
+     *        count of a backlink of an earlier generation of the entry.
+     */
+    Genode::uint32_t links (const ArchiveEntry &) const;
+
+    /**
+     * @brief Drops entries without backlinks and starts a new epoch.
+     *        Should be called once the archive matches a generation on
+     *        disk.
+     */
+    void seal (void);
+
     /**
      * @brief Removes entry from archive.
      */
@@ -255,14 +747,62 @@ namespace Snapper
      */
     void extract_from_archive_file (const Genode::Readonly_file &);
 
+    /**
+     * @brief Reads the delta file provided, and replaces the backlinks
+     * of every key it contains. Keys recorded without a backlink are
+     * removed from the archive.
+     * @throws Snapper::CrashStates
+     */
+    void extract_from_delta_file (const Genode::Readonly_file &);
+
+    /**
+     * @brief Returns the name of the generation a delta file was
+     * based on.
+     * @throws Snapper::CrashStates
+     */
+    static Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+    delta_file_parent (const Genode::Readonly_file &);
+
     /**
      * @brief Returns true if a backlink value is contained in the
-     * archive file.
+     * archive (or delta) file.
      * @throws Snapper::CrashStates
      */
     static bool
     archive_file_contains_backlink (const Genode::Readonly_file &,
-                                    const decltype (Backlink::value) &);
+                                    const decltype (Backlink::value) &,
+                                    bool delta = false);
+
+  private:
+    static Genode::uint64_t
+    _partition (const ArchiveKey key)
+    {
+      return key / PARTITION_KEYS;
+    }
+
+    Genode::String<Vfs::MAX_PATH_LEN> _spill_path (Genode::uint64_t) const;
+
+    /**
+     * @brief The size of the buffer archive and spill files are
+     * streamed through. A fraction of the budget, at most IO_CHUNK
+     * bytes and at least a single record.
+     */
+    Genode::size_t _chunk_size (void) const;
+
+    /**
+     * @brief Pages the partition of the key back in if it was spilled
+     * and marks it as the most recently used one.
+     */
+    void _make_resident (const ArchiveKey);
+
+    /**
+     * @brief Spills the least recently used partitions, except for the
+     * pinned one, until the backlink slots fit into the budget.
+     */
+    void _enforce_budget (Genode::uint64_t pinned);
+
+    bool _spill (Partition &);
+    void _page_in (Partition &);
   };
 
   class Main : Genode::Noncopyable
@@ -284,9 +824,71 @@ namespace Snapper
     Result take_snapshot (void const *const, Genode::uint64_t,
                           Archive::ArchiveKey);
 
+    /**
+     * @brief Snapshot of a single key, taken as part of a batch (see
+     *        take_snapshots()).
+     */
+    struct Snapshot_request
+    {
+      void const *payload;
+      Genode::uint64_t size;
+      Archive::ArchiveKey identifier;
+      Snapper::HASH hash;
+      Snapper::VERSION version;
+
+      /**
+       * @brief Set by take_snapshots().
+       */
+      Result result;
+    };
+
+    /**
+     * @brief Takes a snapshot of each request, as if take_snapshot()
+     *        was called for each one in order. The payloads are hashed
+     *        by the worker threads (see Config::workers).
+     */
+    Result take_snapshots (Snapshot_request *, Genode::size_t);
+
+    /**
+     * @brief Links the key to the snapshot file of its previous
+     *        payload, if that payload has the given size and hash.
+     *        Returns PayloadNeeded otherwise, in which case the
+     *        payload must be passed to take_snapshot().
+     */
+    Result probe_snapshot (Genode::uint64_t, Snapper::HASH,
+                           Archive::ArchiveKey);
+
+    /**
+     * @brief Drops the key from the snapshot, so it is not carried
+     *        forward into the committed generation.
+     */
+    Result discard (Archive::ArchiveKey);
+
+    /**
+     * @brief Begins a snapshot of the key whose payload is passed in
+     *        pieces (see append_snapshot()), for payloads which do not
+     *        fit into a single buffer. Only one such snapshot can be in
+     *        progress at a time.
+     */
+    Result begin_snapshot (Archive::ArchiveKey);
+
+    /**
+     * @brief Appends the next piece of the payload to the snapshot
+     *        begun by begin_snapshot().
+     */
+    Result append_snapshot (void const *const, Genode::uint64_t);
+
+    /**
+     * @brief Completes the snapshot begun by begin_snapshot(), as if
+     *        the concatenated pieces were passed to take_snapshot().
+     */
+    Result finish_snapshot (void);
+
     /**
      * @brief Completes the snapshot process by saving the archiver's
-     *        contents into the archive file.
+     *        contents into the archive file. Returns WriteFailed, and
+     *        aborts the snapshot, if staged payloads could not be
+     *        written in the background.
      *
      * @throw SNAPSHOT_NOT_POSSIBLE
      */
@@ -307,6 +909,42 @@ namespace Snapper
      */
     Result restore (void *, Genode::size_t, Archive::ArchiveKey);
 
+    /**
+     * @brief Restore a snapshot file from an opened generation into a
+     *        buffer of the given capacity, and store the size of the
+     *        restored data. Returns NoData if the data does not fit,
+     *        the size is stored nonetheless.
+     */
+    Result restore (void *, Genode::size_t, Archive::ArchiveKey,
+                    Genode::size_t &);
+
+    /**
+     * @brief Restore the given range of the data of a snapshot file
+     *        from an opened generation. Returns NoData if the range
+     *        exceeds the data. The whole data is verified against its
+     *        hash on the first access to the key, later ranges of the
+     *        key are read without hashing.
+     */
+    Result restore_range (void *, Genode::size_t, Genode::size_t,
+                          Archive::ArchiveKey);
+
+    /**
+     * @brief Reads the payloads of the keys [first, first + count) of
+     *        the opened generation ahead into memory, so restore() of
+     *        these keys does not wait for the file system. The files
+     *        are read in the order of their paths, which follows the
+     *        order they were created in, and their hashes are verified
+     *        by the worker threads. At most PREFETCH_KEYS keys and
+     *        Config::read_ahead bytes are prefetched per call.
+     *        Replaces the previously prefetched payloads.
+     */
+    Result prefetch (Archive::ArchiveKey, Genode::uint64_t);
+
+    enum
+    {
+      PREFETCH_KEYS = 256
+    };
+
     /**
      * @brief End the restoration procedure.
      */
@@ -341,6 +979,17 @@ namespace Snapper
 
     Config config;
 
+    /**
+     * @brief Threads which take part in hashing batches of payloads.
+     */
+    Genode::Constructible<Worker_pool> pool;
+
+    /**
+     * @brief I/O buffers of `bufsize` bytes, borrowed instead of
+     * allocating a buffer per snapshot file.
+     */
+    Genode::Constructible<Buffer_pool> buffers;
+
   private:
     State state = Dormant;
 
@@ -389,18 +1038,257 @@ namespace Snapper
      */
     Genode::Microseconds snap_start {0};
 
+    /**
+     * @brief The name of the currently initialized generation.
+     */
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        generation_name;
+
     /**
      * @brief Stores and process the archive information for the
      * current snapshot.
      */
     Genode::Reconstructible<Archive> archiver;
 
-    
+    /**
+     * @brief The generation whose archive the archiver currently
+     * mirrors. Empty if the archiver does not match any generation on
+     * disk, in which case the next commit writes a full archive.
+     */
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        archiver_gen;
+
+    /**
+     * @brief The number of delta generations between `archiver_gen`
+     * and its closest full archive.
+     */
+    Genode::uint64_t delta_chain = 0;
+
+    /**
+     * @brief The most recently opened or committed generation. Future
+     * snapshots are based on it, but its archive is only loaded into
+     * the archiver once a snapshot is initialized.
+     */
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        basis_gen;
+
+    /**
+     * @brief Index of the currently opened generation used by
+     * restore().
+     */
+    Archive::Index *index = nullptr;
+
+    /**
+     * @brief The verified snapshot file of each key that was restored
+     * by restore_range() from the opened generation.
+     */
+    struct Verified
+    {
+      Genode::String<Vfs::MAX_PATH_LEN> value;
+
+      Verified (const Genode::String<Vfs::MAX_PATH_LEN> &value) : value (value)
+      {
+      }
+    };
+
+    FlatDictionary<Verified, Archive::ArchiveKey> verified{ heap };
+
+    /**
+     * @brief A verified payload in the read-ahead buffer (see
+     * prefetch()).
+     */
+    struct Prefetched
+    {
+      Genode::size_t offset;
+      Genode::size_t size;
+
+      Prefetched (Genode::size_t offset, Genode::size_t size)
+          : offset (offset), size (size)
+      {
+      }
+    };
+
+    char *read_ahead = nullptr;
+    Genode::size_t read_ahead_used = 0;
+    FlatDictionary<Prefetched, Archive::ArchiveKey> prefetched{ heap };
+
+    /**
+     * @brief Drops all prefetched payloads. The read-ahead buffer is
+     * freed as well if `release` is set.
+     */
+    void __clear_read_ahead (bool release);
+
+    /**
+     * @brief Header of a payload in the staging area, whose snapshot
+     * file is written behind (see Config::write_behind). The payload
+     * directly follows the header.
+     */
+    struct Staged
+    {
+      Archive::ArchiveKey identifier;
+      Genode::uint64_t size;
+      Snapper::HASH hash;
+      Snapper::VERSION version;
+
+      static constexpr Genode::size_t
+      space (Genode::uint64_t size)
+      {
+        return (sizeof (Staged) + size + alignof (Staged) - 1)
+               & ~(Genode::size_t)(alignof (Staged) - 1);
+      }
+    };
+
+    enum
+    {
+      /**
+       * @brief The number of staged payloads written per flush signal,
+       * so RPCs are served in between.
+       */
+      FLUSH_BATCH = 8
+    };
+
+    char *staging = nullptr;
+    Genode::size_t staging_head = 0;
+    Genode::size_t staging_tail = 0;
+
+    /**
+     * @brief Writes the snapshot files of the staged payloads.
+     */
+    Vfs_writer writer{ static_cast<Vfs::Simple_env &> (snapper_root) };
+
+    /**
+     * @brief Updates reference counts in place. It is separate from
+     * `writer`, whose files may be in flight while a staged payload is
+     * deduplicated.
+     */
+    Vfs_writer rc_writer{ static_cast<Vfs::Simple_env &> (snapper_root) };
+
+    Genode::Signal_handler<Main> flush_handler;
+
+    /**
+     * @brief Set if a flush in the background failed. The staged
+     * payloads are lost, hence the snapshot cannot be committed.
+     */
+    bool flush_failed = false;
+
+    /**
+     * @brief Copies the payload into the staging area, hashing it on
+     * the way (see __copy_and_hash()), and schedules the flush. Returns
+     * false if write-behind is disabled or the payload does not fit
+     * into the staging area at all.
+     * @throws Snapper::CrashStates
+     */
+    bool __stage (void const *const, Genode::uint64_t, Archive::ArchiveKey);
+
+    /**
+     * @brief Writes up to the given number of staged payloads, in the
+     * order they were staged. Up to Vfs_writer::MAX_FILES snapshot
+     * files are in flight at once.
+     * @throws Snapper::CrashStates
+     */
+    void __flush_staged (Genode::size_t = ~(Genode::size_t)0);
+
+    void __handle_flush (void);
+
+    /**
+     * @brief The snapshot in progress of begin_snapshot(). Its pieces
+     * are appended to a new snapshot file behind a placeholder header,
+     * whose hash is patched once the payload is complete.
+     */
+    struct Upload
+    {
+      Archive::ArchiveKey identifier;
+      Genode::uint64_t size = 0;
+      Hasher hash;
+
+      /**
+       * @brief Path of the snapshot file, relative to `snapper_root`.
+       */
+      Genode::String<Vfs::MAX_PATH_LEN> path;
+      Genode::New_file file;
+
+      Upload (Genode::Directory &dir,
+              const Genode::String<Vfs::Directory_service::Dirent::Name::
+                                       MAX_LEN> &name,
+              const Genode::String<Vfs::MAX_PATH_LEN> &path,
+              Archive::ArchiveKey identifier, Hash_id hash_id)
+          : identifier (identifier), hash (hash_id), path (path),
+            file (dir, name)
+      {
+      }
+    };
+
+    Genode::Constructible<Upload> upload;
+
     /**
      * @brief Checks if archive file exists and has a valid CRC.
      */
     bool __valid_archive (const Genode::Path<Vfs::MAX_PATH_LEN> &);
 
+    /**
+     * @brief Checks if the generation has either a valid archive or a
+     * valid delta file.
+     */
+    bool __valid_gen (
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+            &);
+
+    /**
+     * @brief Entries of <snapper-root> starting with a dot are not
+     * generations (e.g. the spill files of the archiver).
+     */
+    static bool
+    __hidden_entry (Genode::Directory::Entry &entry)
+    {
+      return entry.name ().string ()[0] == '.';
+    }
+
+    /**
+     * @brief Returns the path to the generation's archive file, or to
+     * its delta file if the generation has no full archive. Returns an
+     * empty path for invalid generations.
+     */
+    Genode::String<Vfs::MAX_PATH_LEN> __archive_path (
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+            &);
+
+    /**
+     * @brief Materializes the archive of a generation into the given
+     * archive by applying its chain of delta files on top of the
+     * closest full archive. Returns the length of the delta chain.
+     * @throws Snapper::CrashStates
+     */
+    Genode::uint64_t __extract_gen (
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+            &,
+        Archive &);
+
+    /**
+     * @brief Creates the index (and the index of each parent for delta
+     * generations) of a generation.
+     * @throws Snapper::CrashStates
+     * @throws Genode::File::Open_failed
+     */
+    Archive::Index *__index_gen (
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+            &);
+
+    /**
+     * @brief Loads the archive of `basis_gen` into the archiver, unless
+     * the archiver already mirrors it.
+     */
+    void __load_basis (void);
+
+    /**
+     * @brief Rewrites every delta generation based on the given
+     * generation as a full archive, so the given generation can be
+     * removed without breaking the delta chain.
+     * @throws Snapper::CrashStates
+     */
+    void __rebase_children (
+        const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+            &);
+
     /**
      * @brief Removes the last generation if it does not contain a
      * valid archive file (i.e. it is an incomplete snapshot).
@@ -419,8 +1307,9 @@ namespace Snapper
     void __reset_gen (void);
 
     /**
-     * @brief Tries to load the archive file from the specified
-     * generation into archiver.
+     * @brief Tries to index the archive file of the specified
+     * generation for restore(). The archive is loaded into the
+     * archiver on demand (see __load_basis()).
      *
      * If a generation is not specified, the latest generation will be used.
      */
@@ -429,19 +1318,89 @@ namespace Snapper
             & = "");
 
     /**
-     * @brief Aborts the snapshot by removing the snapshot and
-     *        generation directories.
+     * @brief Returns the hash of the snapshot file of a payload of the
+     *        given size.
      */
-    void __abort_snapshot (void);
+    Hash_id __hash_id (Genode::uint64_t);
+
+    /**
+     * @brief Hashes the payload with the hash of __hash_id() and
+     *        stores the version byte of its snapshot file. The leaves
+     *        of the tree hash are hashed by the worker threads if
+     *        `parallel` is set, which must not be done by a worker
+     *        itself.
+     */
+    Snapper::HASH __hash (void const *const, Genode::uint64_t,
+                          Snapper::VERSION &, bool parallel);
+
+    /**
+     * @brief Like __hash(), but also copies the payload to `dst`. The
+     *        payload is hashed while it is copied, except for the tree
+     *        hash, whose leaves are hashed by the worker threads.
+     */
+    Snapper::HASH __copy_and_hash (void *, void const *const,
+                                   Genode::uint64_t, Snapper::VERSION &);
+
+    /**
+     * @brief Increments the reference count of the latest backlink of
+     *        the key, if it holds a payload with the given hash and
+     *        size. Returns false if a new backlink is needed.
+     */
+    bool __reuse_backlink (Archive::ArchiveKey, Snapper::HASH,
+                           Genode::uint64_t, Snapper::VERSION = Version);
+
+    /**
+     * @brief Returns true if the snapshot file of the backlink was
+     *        written by the current snapshot.
+     */
+    bool __written_now (const Archive::Backlink &);
+
+    /**
+     * @brief Writes the payload to a new snapshot file and adds its
+     *        backlink to the archive.
+     * @throws Snapper::CrashStates
+     */
+    void __write_backlink (void const *const, Genode::uint64_t,
+                           Snapper::HASH, Archive::ArchiveKey,
+                           Snapper::VERSION = Version);
+
+    /**
+     * @brief Returns the name of the next snapshot file, relative to
+     *        `snapshot_dir_path`. Moves on to a new extender directory
+     *        once the current one reached the threshold.
+     * @throws Snapper::CrashStates
+     */
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+    __next_backlink_name (void);
+
+    /**
+     * @brief Drops the snapshot in progress of begin_snapshot(), if
+     *        any, and removes its snapshot file.
+     */
+    void __drop_upload (void);
+
+    /**
+     * @brief Copies the data of the backlink to a new snapshot file of
+     *        the key.
+     * @throws Snapper::CrashStates
+     */
+    void __copy_backlink (Archive::Backlink &, Archive::ArchiveKey);
+
+    /**
+     * @brief Increments the reference count of the latest backlink of
+     *        every key that was not submitted during the current
+     *        snapshot, as the committed generation references it as
+     *        well. Creates a redundant copy once the reference count
+     *        reaches the redundancy.
+     * @throws Snapper::CrashStates
+     */
+    void __carry_forward (void);
 
     /**
-     * @brief Updates the reference counts of all backlinks stored
-     *        in the archiver. Should only be called after the archive file has
-     *        been saved, else if the archive file cannot be saved there could
-     *        be "zombie" snapshot files which will never be removed from the
-     *        file-system!
+     * @brief Aborts the snapshot by removing the snapshot and
+     *        generation directories.
      */
-    void __update_references (void);
+    void __abort_snapshot (void);
 
     /**
      * @brief Returns the number of valid generations.
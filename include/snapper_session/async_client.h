@@ -0,0 +1,132 @@
+/**
+ * @brief Client-side asynchronous snapshot queue.
+ * @author Rumen Mitov
+ * @date 2025-08-23
+ */
+
+#ifndef __SNAPPER_SESSION_ASYNC_CLIENT_H
+#define __SNAPPER_SESSION_ASYNC_CLIENT_H
+
+#include "client.h"
+#include <base/allocator_avl.h>
+#include <packet_stream_tx/client.h>
+
+namespace Snapper
+{
+  class Async_client;
+}
+
+/**
+ * @brief Queues snapshots on the packet stream of a Snapper session.
+ *        The client keeps submitting payloads while the server takes
+ *        the snapshots, and collects the results once the server
+ *        acknowledged them.
+ *
+ *        All submitted snapshots must be completed before the
+ *        snapshot is committed (see pending()).
+ */
+class Snapper::Async_client : Genode::Noncopyable
+{
+private:
+  using Local_rm = Genode::Local::Constrained_region_map;
+
+  Genode::Allocator_avl _tx_alloc;
+  Packet_stream_tx::Client<Session::Tx> _tx;
+
+  Genode::size_t _pending = 0;
+
+public:
+  Async_client (Session_client &session, Local_rm &local_rm,
+                Genode::Allocator &md_alloc)
+      : _tx_alloc (&md_alloc), _tx (session._tx_cap (), local_rm, _tx_alloc)
+  {
+  }
+
+  /**
+   * @brief Registers the handler which is notified when snapshots are
+   *        completed or the queue has room again.
+   */
+  void
+  sigh (Genode::Signal_context_capability sigh)
+  {
+    _tx.sigh_ack_avail (sigh);
+    _tx.sigh_ready_to_submit (sigh);
+  }
+
+  /**
+   * @brief Queues a snapshot of the payload. Returns false if the
+   *        queue or its bulk buffer is full, in which case completions
+   *        must be collected first.
+   */
+  bool
+  submit (void const *const payload, Genode::size_t size,
+          Archive::ArchiveKey identifier)
+  {
+    return submit_in_place (
+        size, identifier, [&] (Genode::Byte_range_ptr const &buf) {
+          Genode::memcpy (buf.start, payload, size);
+        });
+  }
+
+  /**
+   * @brief Reserves a packet of the given size and calls fn() with its
+   *        content, which fn() fills with the payload in place. The
+   *        packet is submitted once fn() returns. Returns false
+   *        without calling fn() if the queue or its bulk buffer is
+   *        full.
+   */
+  template <typename FN>
+  bool
+  submit_in_place (Genode::size_t size, Archive::ArchiveKey identifier,
+                   FN const &fn)
+  {
+    Session::Tx::Source &source = *_tx.source ();
+
+    if (!source.ready_to_submit ())
+      return false;
+
+    return source.alloc_packet_attempt (size).convert<bool> (
+        [&] (Genode::Packet_descriptor p) {
+          Session::Packet_descriptor packet (p, identifier);
+
+          fn (Genode::Byte_range_ptr (source.packet_content (packet), size));
+          source.submit_packet (packet);
+          source.wakeup ();
+
+          _pending++;
+          return true;
+        },
+        [] (auto) { return false; });
+  }
+
+  /**
+   * @brief Calls fn() with the key and the result of each completed
+   *        snapshot.
+   */
+  template <typename FN>
+  void
+  for_each_completion (FN const &fn)
+  {
+    Session::Tx::Source &source = *_tx.source ();
+
+    while (source.ack_avail ())
+      {
+        Session::Packet_descriptor packet = source.get_acked_packet ();
+        fn (packet.key (), packet.result ());
+
+        source.release_packet (packet);
+        _pending--;
+      }
+  }
+
+  /**
+   * @brief Number of submitted snapshots that are not completed yet.
+   */
+  Genode::size_t
+  pending (void) const
+  {
+    return _pending;
+  }
+};
+
+#endif // __SNAPPER_SESSION_ASYNC_CLIENT_H
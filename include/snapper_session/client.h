@@ -8,13 +8,53 @@
 #define __SNAPPER_SESSION_CLIENT_H
 
 #include "snapper_session.h"
+#include "xxhash32.h"
 #include <base/rpc_client.h>
 
 namespace Snapper
 {
   class Session_client;
+  struct Take_request;
+  struct Restore_request;
 }
 
+/**
+ * @brief Snapshot of a single key, submitted as part of a batch (see
+ *        Session_client::take_snapshots()).
+ */
+struct Snapper::Take_request
+{
+  Archive::ArchiveKey key;
+  void const *payload;
+  Genode::size_t size;
+
+  /**
+   * @brief Set by take_snapshots().
+   */
+  Result result = InvalidState;
+};
+
+/**
+ * @brief Restoration of a single key, submitted as part of a batch (see
+ *        Session_client::restore_batch()).
+ */
+struct Snapper::Restore_request
+{
+  Archive::ArchiveKey key;
+  void *dest;
+
+  /**
+   * @brief The size of dest. Set to the size of the restored data by
+   *        restore_batch().
+   */
+  Genode::size_t size;
+
+  /**
+   * @brief Set by restore_batch(). NoData if dest is too small.
+   */
+  Result result = InvalidState;
+};
+
 class Snapper::Session_client : public Genode::Rpc_client<Session>
 {
 private:
@@ -44,18 +84,43 @@ public:
     return call<Rpc_dataspace> ();
   }
 
+  Genode::Capability<Tx>
+  _tx_cap (void) override
+  {
+    return call<Rpc_tx_cap> ();
+  }
+
   Result
   _take_snapshot (Genode::size_t size, Archive::ArchiveKey identifier) override
   {
     return call<Rpc_take_snapshot> (size, identifier);
   }
 
+  Result
+  _take_snapshots (Genode::size_t count) override
+  {
+    return call<Rpc_take_snapshots> (count);
+  }
+
   Result
   _restore (Genode::size_t size, Archive::ArchiveKey identifier) override
   {
     return call<Rpc_restore> (size, identifier);
   }
 
+  Result
+  _restore_range (Genode::size_t offset, Genode::size_t length,
+                  Archive::ArchiveKey identifier) override
+  {
+    return call<Rpc_restore_range> (offset, length, identifier);
+  }
+
+  Genode::size_t
+  _restore_batch (Genode::size_t count) override
+  {
+    return call<Rpc_restore_batch> (count);
+  }
+
   Result
   init_snapshot (void) override
   {
@@ -65,13 +130,213 @@ public:
   Result
   take_snapshot (void const *const payload, Genode::size_t size,
                  Archive::ArchiveKey identifier)
+  {
+    return with_snapshot_buffer (
+        size, identifier, [&] (Genode::Byte_range_ptr const &buf) {
+          Genode::memcpy (buf.start, payload, size);
+        });
+  }
+
+  /**
+   * @brief Calls fn() with a region of the communication buffer of the
+   *        given size, which fn() fills with the payload in place.
+   *        The snapshot is taken once fn() returns. The region must
+   *        not be used outside of fn().
+   */
+  template <typename FN>
+  Result
+  with_snapshot_buffer (Genode::size_t size, Archive::ArchiveKey identifier,
+                        FN const &fn)
   {
     Genode::Mutex::Guard _guard (_mutex);
-    Genode::memcpy (_io_buffer.local_addr<void> (), payload, size);
+
+    if (size > _io_buffer.size ())
+      return InvalidState;
+
+    fn (Genode::Byte_range_ptr (_io_buffer.local_addr<char> (), size));
 
     return call<Rpc_take_snapshot> (size, identifier);
   }
 
+  /**
+   * @brief Takes a snapshot of each request. As many requests as fit
+   *        into the communication buffer are submitted with a single
+   *        RPC. The result of each request is stored in the request.
+   *        Returns Ok if all snapshots succeeded, the first failed
+   *        result otherwise.
+   */
+  Result
+  take_snapshots (Take_request *requests, Genode::size_t count)
+  {
+    Genode::Mutex::Guard _guard (_mutex);
+
+    char *buf = _io_buffer.local_addr<char> ();
+    const Genode::size_t buf_size = _io_buffer.size ();
+
+    Result res = Ok;
+    Genode::size_t i = 0;
+
+    while (i < count)
+      {
+        Genode::size_t first = i;
+        Genode::size_t offset = 0;
+
+        while (i < count
+               && Session::Record::space (requests[i].size)
+                      <= buf_size - offset)
+          {
+            Session::Record &record
+                = *reinterpret_cast<Session::Record *> (buf + offset);
+
+            record.key = requests[i].key;
+            record.size = requests[i].size;
+            record.result = InvalidState;
+
+            Genode::memcpy (buf + offset + sizeof (Session::Record),
+                            requests[i].payload, requests[i].size);
+
+            offset += Session::Record::space (requests[i].size);
+            i++;
+          }
+
+        // INFO The payload does not fit into the communication buffer
+        // at all.
+        if (i == first)
+          {
+            requests[i].result = InvalidState;
+            if (res == Ok)
+              res = InvalidState;
+
+            i++;
+            continue;
+          }
+
+        (void)call<Rpc_take_snapshots> (i - first);
+
+        offset = 0;
+        for (Genode::size_t j = first; j < i; j++)
+          {
+            const Session::Record &record
+                = *reinterpret_cast<Session::Record *> (buf + offset);
+
+            requests[j].result = record.result;
+            if (res == Ok && record.result != Ok)
+              res = record.result;
+
+            offset += Session::Record::space (requests[j].size);
+          }
+      }
+
+    return res;
+  }
+
+  Result
+  probe_snapshot (Genode::size_t size, Snapper::HASH hash,
+                  Archive::ArchiveKey identifier) override
+  {
+    return call<Rpc_probe_snapshot> (size, hash, identifier);
+  }
+
+  /**
+   * @brief Takes a snapshot of the payload, but only transfers it if
+   *        the server cannot reuse the previous snapshot of the key
+   *        (see probe_snapshot()).
+   */
+  Result
+  take_snapshot_probed (void const *const payload, Genode::size_t size,
+                        Archive::ArchiveKey identifier)
+  {
+    Result res = probe_snapshot (size, xxhash32 (payload, size), identifier);
+
+    if (res != PayloadNeeded)
+      return res;
+
+    return take_snapshot (payload, size, identifier);
+  }
+
+  Result
+  discard (Archive::ArchiveKey identifier) override
+  {
+    return call<Rpc_discard> (identifier);
+  }
+
+  Result
+  attach_region (Genode::Dataspace_capability region) override
+  {
+    return call<Rpc_attach_region> (region);
+  }
+
+  Result
+  take_snapshot_region (Genode::off_t offset, Genode::size_t size,
+                        Archive::ArchiveKey identifier) override
+  {
+    return call<Rpc_take_snapshot_region> (offset, size, identifier);
+  }
+
+  Result
+  begin_snapshot (Archive::ArchiveKey identifier) override
+  {
+    return call<Rpc_begin_snapshot> (identifier);
+  }
+
+  Result
+  _append_snapshot (Genode::size_t size) override
+  {
+    return call<Rpc_append_snapshot> (size);
+  }
+
+  /**
+   * @brief Appends the next piece of the payload to the snapshot begun
+   *        by begin_snapshot(). Pieces larger than the communication
+   *        buffer are split.
+   */
+  Result
+  append_snapshot (void const *const payload, Genode::size_t size)
+  {
+    Genode::Mutex::Guard _guard (_mutex);
+
+    char const *src = (char const *)payload;
+    Result res = Ok;
+
+    while (size && res == Ok)
+      {
+        Genode::size_t piece = Genode::min (size, _io_buffer.size ());
+
+        Genode::memcpy (_io_buffer.local_addr<char> (), src, piece);
+        res = call<Rpc_append_snapshot> (piece);
+
+        src += piece;
+        size -= piece;
+      }
+
+    return res;
+  }
+
+  Result
+  finish_snapshot (void) override
+  {
+    return call<Rpc_finish_snapshot> ();
+  }
+
+  /**
+   * @brief Takes a snapshot of a payload of any size by streaming it
+   *        through the communication buffer (see begin_snapshot()).
+   */
+  Result
+  take_snapshot_streamed (void const *const payload, Genode::size_t size,
+                          Archive::ArchiveKey identifier)
+  {
+    Result res = begin_snapshot (identifier);
+    if (res != Ok)
+      return res;
+
+    res = append_snapshot (payload, size);
+    if (res != Ok)
+      return res;
+
+    return finish_snapshot ();
+  }
+
   Result
   commit_snapshot (void) override
   {
@@ -98,6 +363,136 @@ public:
     return res;
   }
 
+  /**
+   * @brief Restores the key into the communication buffer and calls
+   *        fn() with the restored data, which can be read in place.
+   *        fn() is only called if the restoration succeeded, and the
+   *        data must not be used outside of fn().
+   */
+  template <typename FN>
+  Result
+  with_restored (Genode::size_t size, Archive::ArchiveKey identifier,
+                 FN const &fn)
+  {
+    Genode::Mutex::Guard _guard (_mutex);
+
+    if (size > _io_buffer.size ())
+      return InvalidState;
+
+    Result res = call<Rpc_restore> (size, identifier);
+
+    if (res == Ok)
+      fn (Genode::Const_byte_range_ptr (_io_buffer.local_addr<char const> (),
+                                        size));
+
+    return res;
+  }
+
+  /**
+   * @brief Restores `length` bytes of the data of the key, starting at
+   *        the offset. Returns NoData if the range exceeds the data.
+   */
+  Result
+  restore_range (void *dest, Genode::size_t offset, Genode::size_t length,
+                 Archive::ArchiveKey identifier)
+  {
+    Genode::Mutex::Guard _guard (_mutex);
+
+    if (length > _io_buffer.size ())
+      return InvalidState;
+
+    Result res = call<Rpc_restore_range> (offset, length, identifier);
+
+    if (res == Ok)
+      Genode::memcpy (dest, _io_buffer.local_addr<void> (), length);
+
+    return res;
+  }
+
+  /**
+   * @brief Restores the key of each request. As many payloads as fit
+   *        into the communication buffer are returned by a single
+   *        RPC, the remaining keys are resubmitted. The result of each
+   *        request is stored in the request. Returns Ok if all keys
+   *        were restored, the first failed result otherwise.
+   */
+  Result
+  restore_batch (Restore_request *requests, Genode::size_t count)
+  {
+    Genode::Mutex::Guard _guard (_mutex);
+
+    char *buf = _io_buffer.local_addr<char> ();
+    Session::Record *records = reinterpret_cast<Session::Record *> (buf);
+
+    // INFO The key table takes at most half of the buffer, the rest is
+    // left for the payloads.
+    Genode::size_t max_records = Genode::max (
+        _io_buffer.size () / 2 / sizeof (Session::Record), (Genode::size_t)1);
+
+    Result res = Ok;
+    Genode::size_t i = 0;
+
+    while (i < count)
+      {
+        Genode::size_t num_records = Genode::min (count - i, max_records);
+
+        for (Genode::size_t j = 0; j < num_records; j++)
+          {
+            records[j].key = requests[i + j].key;
+            records[j].size = 0;
+            records[j].result = InvalidState;
+          }
+
+        Genode::size_t done = call<Rpc_restore_batch> (num_records);
+
+        // INFO The table left no room for the payload of the first key,
+        // which is retried with fewer keys.
+        if (!done && num_records > 1)
+          {
+            max_records = num_records / 2;
+            continue;
+          }
+
+        if (!done)
+          return InvalidState;
+
+        Genode::size_t offset
+            = Session::Record::align (num_records * sizeof (Session::Record));
+
+        for (Genode::size_t j = 0; j < done; j++)
+          {
+            Restore_request &request = requests[i + j];
+            request.result = records[j].result;
+
+            if (records[j].result == Ok)
+              {
+                if (records[j].size > request.size)
+                  request.result = NoData;
+                else
+                  Genode::memcpy (request.dest, buf + offset,
+                                  records[j].size);
+
+                offset += Session::Record::align (records[j].size);
+              }
+
+            request.size = records[j].size;
+
+            if (res == Ok && request.result != Ok)
+              res = request.result;
+          }
+
+        i += done;
+      }
+
+    return res;
+  }
+
+  Result
+  prefetch (Archive::ArchiveKey first, Genode::uint64_t count) override
+  {
+    return call<Rpc_prefetch> (first, count);
+  }
+
   Result
   close_generation (void) override
   {
@@ -0,0 +1,260 @@
+/**
+ * @brief Client-side cache of the payload hashes of the previous
+ *        snapshots.
+ * @author Rumen Mitov
+ * @date 2025-08-23
+ */
+
+#ifndef __SNAPPER_SESSION_HASH_CACHE_H
+#define __SNAPPER_SESSION_HASH_CACHE_H
+
+#include "client.h"
+#include "flat_dictionary.h"
+#include "xxhash32.h"
+
+namespace Snapper
+{
+  class Hash_cache;
+}
+
+/**
+ * @brief Remembers the size and hash of the last payload of each key.
+ *        Unchanged payloads are not submitted at all, the server
+ *        carries their keys forward when the snapshot is committed.
+ *        Keys which no longer exist must be discarded (see
+ *        discard()).
+ *
+ *        Callers which track modifications themselves can mark keys
+ *        as dirty and use take_snapshot_if_dirty(), which skips even
+ *        hashing the payloads of clean keys.
+ *
+ *        The hashes of a snapshot only replace the cached ones once
+ *        it is committed, hence snapshots taken through the cache must
+ *        be initialized and committed through it as well (see
+ *        init_snapshot() and commit_snapshot()).
+ */
+class Snapper::Hash_cache : Genode::Noncopyable
+{
+private:
+  struct Entry
+  {
+    /**
+     * @brief The payload of the last committed snapshot of the key.
+     */
+    bool committed = false;
+    Snapper::HASH hash = 0;
+    Genode::size_t size = 0;
+
+    /**
+     * @brief The payload taken during the current snapshot.
+     */
+    bool staged = false;
+    Snapper::HASH staged_hash = 0;
+    Genode::size_t staged_size = 0;
+
+    bool dirty = false;
+
+    /**
+     * @brief Returns false if the server does not know the payload of
+     * the key, otherwise the hash and size of the payload the server
+     * would carry forward.
+     */
+    bool
+    latest (Snapper::HASH &latest_hash, Genode::size_t &latest_size) const
+    {
+      if (!staged && !committed)
+        return false;
+
+      latest_hash = staged ? staged_hash : hash;
+      latest_size = staged ? staged_size : size;
+      return true;
+    }
+  };
+
+  Session_client &_session;
+  FlatDictionary<Entry, Archive::ArchiveKey> _entries;
+
+  Result
+  _take_snapshot (void const *const payload, Genode::size_t size,
+                  Snapper::HASH hash, Archive::ArchiveKey identifier)
+  {
+    Result res = _session.take_snapshot (payload, size, identifier);
+
+    if (res != Ok)
+      {
+        _entries.remove (identifier);
+        return res;
+      }
+
+    auto stage = [&] (Entry &entry) {
+      entry.staged = true;
+      entry.staged_hash = hash;
+      entry.staged_size = size;
+      entry.dirty = false;
+    };
+
+    _entries.with_element (identifier, stage, [&] () {
+      stage (_entries.insert (identifier));
+    });
+
+    return res;
+  }
+
+  /**
+   * @brief Drops the payloads of the current snapshot. Their keys are
+   *        marked as dirty, as they were taken for a reason.
+   */
+  void
+  _drop_staged (void)
+  {
+    _entries.remove_if ([] (Entry const &entry) {
+      return entry.staged && !entry.committed;
+    });
+
+    _entries.for_each ([] (Entry &entry) {
+      if (!entry.staged)
+        return;
+
+      entry.staged = false;
+      entry.dirty = true;
+    });
+  }
+
+public:
+  Hash_cache (Session_client &session, Genode::Allocator &alloc)
+      : _session (session), _entries (alloc)
+  {
+  }
+
+  /**
+   * @brief Initializes a snapshot. Payloads taken since the last
+   *        commit are dropped, the server abandoned them as well.
+   */
+  Result
+  init_snapshot (void)
+  {
+    _drop_staged ();
+    return _session.init_snapshot ();
+  }
+
+  /**
+   * @brief Commits the snapshot. The hashes of the payloads taken
+   *        during it are only cached if the commit succeeded.
+   */
+  Result
+  commit_snapshot (void)
+  {
+    Result res = _session.commit_snapshot ();
+
+    if (res != Ok)
+      {
+        _drop_staged ();
+        return res;
+      }
+
+    _entries.for_each ([] (Entry &entry) {
+      if (!entry.staged)
+        return;
+
+      entry.committed = true;
+      entry.hash = entry.staged_hash;
+      entry.size = entry.staged_size;
+      entry.staged = false;
+    });
+
+    return res;
+  }
+
+  /**
+   * @brief Takes a snapshot of the payload, which is only transferred
+   *        if its hash differs from the one of the last snapshot of
+   *        the key.
+   */
+  Result
+  take_snapshot (void const *const payload, Genode::size_t size,
+                 Archive::ArchiveKey identifier)
+  {
+    Snapper::HASH hash = xxhash32 (payload, size);
+    bool unchanged = false;
+
+    _entries.with_element (
+        identifier,
+        [&] (Entry &entry) {
+          Snapper::HASH latest_hash;
+          Genode::size_t latest_size;
+
+          unchanged = entry.latest (latest_hash, latest_size)
+                      && latest_size == size && latest_hash == hash;
+        },
+        [] () {});
+
+    if (unchanged)
+      return Ok;
+
+    return _take_snapshot (payload, size, hash, identifier);
+  }
+
+  /**
+   * @brief Takes a snapshot of the payload if the key was marked as
+   *        dirty (see mark_dirty()) or has not been snapshotted yet.
+   *        Clean keys are carried forward by the server without
+   *        looking at the payload.
+   */
+  Result
+  take_snapshot_if_dirty (void const *const payload, Genode::size_t size,
+                          Archive::ArchiveKey identifier)
+  {
+    bool clean = false;
+
+    _entries.with_element (
+        identifier,
+        [&] (Entry &entry) {
+          Snapper::HASH latest_hash;
+          Genode::size_t latest_size;
+
+          clean = !entry.dirty && entry.latest (latest_hash, latest_size)
+                  && latest_size == size;
+        },
+        [] () {});
+
+    if (clean)
+      return Ok;
+
+    return _take_snapshot (payload, size, xxhash32 (payload, size),
+                           identifier);
+  }
+
+  /**
+   * @brief Marks the payload of the key as modified since its last
+   *        snapshot.
+   */
+  void
+  mark_dirty (Archive::ArchiveKey identifier)
+  {
+    _entries.with_element (
+        identifier, [] (Entry &entry) { entry.dirty = true; }, [] () {});
+  }
+
+  /**
+   * @brief Drops the key from the current snapshot and forgets its
+   *        hash.
+   */
+  Result
+  discard (Archive::ArchiveKey identifier)
+  {
+    _entries.remove (identifier);
+    return _session.discard (identifier);
+  }
+
+  /**
+   * @brief Forgets all hashes, e.g. after switching to another
+   *        generation.
+   */
+  void
+  clear (void)
+  {
+    _entries.clear ();
+  }
+};
+
+#endif // __SNAPPER_SESSION_HASH_CACHE_H
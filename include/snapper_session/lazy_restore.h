@@ -0,0 +1,192 @@
+/**
+ * @brief Client-side on-demand restoration of an opened generation.
+ * @author Rumen Mitov
+ * @date 2025-08-23
+ */
+
+#ifndef __SNAPPER_SESSION_LAZY_RESTORE_H
+#define __SNAPPER_SESSION_LAZY_RESTORE_H
+
+#include "client.h"
+#include "flat_dictionary.h"
+
+namespace Snapper
+{
+  class Lazy_restore;
+}
+
+/**
+ * @brief Restores registered keys of the opened generation on first
+ *        use instead of up front. Each key is mapped to the buffer it
+ *        is restored into, which must stay valid until the key is
+ *        restored. The caller touches a key before accessing its
+ *        buffer (see touch()), which also prefetches the following
+ *        keys with a single batched call.
+ *
+ *        The generation must stay open until all touched keys are
+ *        restored, or until restore_all() returns.
+ */
+class Snapper::Lazy_restore : Genode::Noncopyable
+{
+public:
+  enum
+  {
+    MAX_PREFETCH = 16
+  };
+
+private:
+  struct Page
+  {
+    Archive::ArchiveKey key;
+    void *dest;
+    Genode::size_t size;
+    bool restored = false;
+
+    /**
+     * @brief Set if the last attempt to restore the key failed.
+     */
+    bool failed = false;
+
+    Page (Archive::ArchiveKey key, void *dest, Genode::size_t size)
+        : key (key), dest (dest), size (size)
+    {
+    }
+  };
+
+  Session_client &_session;
+  FlatDictionary<Page, Archive::ArchiveKey> _pages;
+
+  Genode::size_t _prefetch;
+
+public:
+  /**
+   * @param prefetch The number of keys following a touched key that
+   *        are restored along with it, at most MAX_PREFETCH.
+   */
+  Lazy_restore (Session_client &session, Genode::Allocator &alloc,
+                Genode::size_t prefetch = 4)
+      : _session (session), _pages (alloc),
+        _prefetch (Genode::min (prefetch, (Genode::size_t)MAX_PREFETCH))
+  {
+  }
+
+  /**
+   * @brief Registers `count` consecutive keys starting at `first`. The
+   *        key `first + i` is restored into `base + i * stride`, with
+   *        at most `stride` bytes.
+   */
+  void
+  add_range (Archive::ArchiveKey first, Genode::size_t count, void *base,
+             Genode::size_t stride)
+  {
+    _pages.reserve (_pages.count () + count);
+
+    for (Genode::size_t i = 0; i < count; i++)
+      if (!_pages.exists (first + i))
+        _pages.insert (first + i, first + i, (char *)base + i * stride,
+                       stride);
+  }
+
+  /**
+   * @brief Restores the key, unless it was restored already, together
+   *        with the registered keys that follow it. Returns NoMatches
+   *        for keys which were not registered.
+   */
+  Result
+  touch (Archive::ArchiveKey key)
+  {
+    Result res = NoMatches;
+
+    _pages.with_element (
+        key, [&] (Page &page) { res = page.restored ? Ok : InvalidState; },
+        [] () {});
+
+    if (res != InvalidState)
+      return res;
+
+    Restore_request requests[1 + MAX_PREFETCH];
+    Page *pages[1 + MAX_PREFETCH];
+    Genode::size_t count = 0;
+
+    _pages.for_each_in_range (key, key + _prefetch, [&] (Page &page) {
+      if (page.restored || count == 1 + _prefetch)
+        return;
+
+      requests[count] = { page.key, page.dest, page.size };
+      pages[count++] = &page;
+    });
+
+    (void)_session.restore_batch (requests, count);
+
+    for (Genode::size_t i = 0; i < count; i++)
+      {
+        pages[i]->restored = requests[i].result == Ok;
+        pages[i]->failed = requests[i].result != Ok;
+
+        if (pages[i]->key == key)
+          res = requests[i].result;
+      }
+
+    return res;
+  }
+
+  /**
+   * @brief Returns true if the key was restored already.
+   */
+  bool
+  restored (Archive::ArchiveKey key)
+  {
+    bool restored = false;
+
+    _pages.with_element (
+        key, [&] (Page &page) { restored = page.restored; }, [] () {});
+
+    return restored;
+  }
+
+  /**
+   * @brief Restores all registered keys that were not touched yet.
+   *        Keys which failed to restore before are not retried.
+   *        Returns Ok if all keys were restored, the first failed
+   *        result otherwise.
+   */
+  Result
+  restore_all (void)
+  {
+    Result res = Ok;
+    Archive::ArchiveKey pending[1 + MAX_PREFETCH];
+
+    // INFO touch() modifies the pages, hence the keys are collected
+    // first.
+    for (bool done = false; !done;)
+      {
+        Genode::size_t count = 0;
+
+        _pages.for_each ([&] (Page const &page) {
+          if (!page.restored && !page.failed && count < 1 + MAX_PREFETCH)
+            pending[count++] = page.key;
+        });
+
+        done = count < 1 + MAX_PREFETCH;
+
+        for (Genode::size_t i = 0; i < count; i++)
+          {
+            if (restored (pending[i]))
+              continue;
+
+            Result touched = touch (pending[i]);
+            if (touched != Ok && res == Ok)
+              res = touched;
+          }
+      }
+
+    _pages.for_each ([&] (Page const &page) {
+      if (page.failed && res == Ok)
+        res = RestoreFailed;
+    });
+
+    return res;
+  }
+};
+
+#endif // __SNAPPER_SESSION_LAZY_RESTORE_H
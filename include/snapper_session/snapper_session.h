@@ -8,8 +8,11 @@
 #define __SNAPPER_SESSION_H
 
 #ifdef __cplusplus
+#include <base/attached_dataspace.h>
 #include <base/attached_ram_dataspace.h>
 #include <base/rpc.h>
+#include <packet_stream_tx/packet_stream_tx.h>
+#include <packet_stream_tx/rpc_object.h>
 #include <session/session.h>
 
 #include "snapper.h"
@@ -34,29 +37,193 @@ struct Snapper::Session : Genode::Session
   /*
    * A terminal session consumes a dataspace capability for the server's
    * session-object allocation, its session capability, and a dataspace
-   * capability for the communication buffer.
+   * capability for the communication buffer. The packet stream is only
+   * created once a client requests it (see _tx_cap()).
    */
   enum
   {
     CAP_QUOTA = 3
   };
 
+  /**
+   * @brief Packet of the asynchronous snapshot queue (see _tx_cap()).
+   *        The payload of the key is stored in the packet's bulk
+   *        buffer, the server stores the result of the snapshot in
+   *        the acknowledged packet.
+   */
+  class Packet_descriptor : public Genode::Packet_descriptor
+  {
+  private:
+    Archive::ArchiveKey _key;
+    Result _result;
+
+  public:
+    Packet_descriptor (Genode::off_t offset = 0, Genode::size_t size = 0)
+        : Genode::Packet_descriptor (offset, size), _key (0),
+          _result (InvalidState)
+    {
+    }
+
+    Packet_descriptor (Genode::Packet_descriptor p, Archive::ArchiveKey key)
+        : Genode::Packet_descriptor (p.offset (), p.size ()), _key (key),
+          _result (InvalidState)
+    {
+    }
+
+    Archive::ArchiveKey
+    key (void) const
+    {
+      return _key;
+    }
+
+    Result
+    result (void) const
+    {
+      return _result;
+    }
+
+    void
+    result (Result result)
+    {
+      _result = result;
+    }
+  };
+
+  enum
+  {
+    TX_QUEUE_SIZE = 64
+  };
+
+  typedef Genode::Packet_stream_policy<Packet_descriptor, TX_QUEUE_SIZE,
+                                       TX_QUEUE_SIZE, char>
+      Tx_policy;
+
+  typedef Packet_stream_tx::Channel<Tx_policy> Tx;
+
+  /**
+   * @brief Header of a record in the communication buffer of a batched
+   *        call. The payload directly follows the header, and each
+   *        record is padded to the alignment of the header.
+   */
+  struct Record
+  {
+    Archive::ArchiveKey key;
+    Genode::uint64_t size;
+    Result result;
+
+    static constexpr Genode::size_t
+    align (Genode::uint64_t size)
+    {
+      return (size + alignof (Record) - 1)
+             & ~(Genode::size_t)(alignof (Record) - 1);
+    }
+
+    /**
+     * @brief Space taken by a record with the given payload size.
+     */
+    static constexpr Genode::size_t
+    space (Genode::uint64_t size)
+    {
+      return align (sizeof (Record) + size);
+    }
+  };
+
   /**
    * @brief Internal method for returning the dataspace used for the
    *        communication buffer.
    */
   virtual Genode::Dataspace_capability _dataspace (void) = 0;
 
+  /**
+   * @brief Internal method for returning the packet stream of the
+   *        asynchronous snapshot queue.
+   */
+  virtual Genode::Capability<Tx> _tx_cap (void) = 0;
+
   /**
    * @brief Internal wrapper that uses the communication buffer.
    */
   virtual Result _take_snapshot (Genode::size_t, Archive::ArchiveKey) = 0;
 
+  /**
+   * @brief Reuses the previous snapshot of the key if its payload has
+   *        the given size and xxhash32. Returns PayloadNeeded if the
+   *        payload must be sent with take_snapshot().
+   */
+  virtual Result probe_snapshot (Genode::size_t, Snapper::HASH,
+                                 Archive::ArchiveKey)
+      = 0;
+
+  /**
+   * @brief Drops the key from the current snapshot. Keys which are not
+   *        submitted are otherwise carried forward from the previous
+   *        generation.
+   */
+  virtual Result discard (Archive::ArchiveKey) = 0;
+
+  /**
+   * @brief Attaches a dataspace of the client, so snapshots can be
+   *        taken straight from it (see take_snapshot_region()). An
+   *        invalid capability detaches the current one.
+   */
+  virtual Result attach_region (Genode::Dataspace_capability) = 0;
+
+  /**
+   * @brief Takes a snapshot of the given range of the attached
+   *        dataspace.
+   */
+  virtual Result take_snapshot_region (Genode::off_t, Genode::size_t,
+                                       Archive::ArchiveKey)
+      = 0;
+
+  /**
+   * @brief Internal wrapper that takes a snapshot of each record
+   *        packed into the communication buffer. The result of each
+   *        record is stored in its header.
+   */
+  virtual Result _take_snapshots (Genode::size_t) = 0;
+
+  /**
+   * @brief Begins a snapshot of the key whose payload is streamed
+   *        through the communication buffer in pieces, for payloads
+   *        larger than the buffer.
+   */
+  virtual Result begin_snapshot (Archive::ArchiveKey) = 0;
+
+  /**
+   * @brief Internal wrapper that appends the next piece of the payload
+   *        from the communication buffer.
+   */
+  virtual Result _append_snapshot (Genode::size_t) = 0;
+
+  /**
+   * @brief Completes the snapshot begun by begin_snapshot().
+   */
+  virtual Result finish_snapshot (void) = 0;
+
   /**
    * @brief Internal wrapper that uses the communication buffer.
    */
   virtual Result _restore (Genode::size_t, Archive::ArchiveKey) = 0;
 
+  /**
+   * @brief Internal wrapper that restores the given range of the data
+   *        of the key into the communication buffer.
+   */
+  virtual Result _restore_range (Genode::size_t, Genode::size_t,
+                                 Archive::ArchiveKey)
+      = 0;
+
+  /**
+   * @brief Internal wrapper that restores the key of each record in
+   *        the table at the start of the communication buffer. The
+   *        payloads are stored after the table, in the order of the
+   *        records. Returns the number of processed records, the
+   *        payloads of the remaining ones did not fit. Returns 0 if
+   *        the table left no room for the first payload.
+   */
+  virtual Genode::size_t _restore_batch (Genode::size_t) = 0;
+
   virtual Result init_snapshot (void) = 0;
 
   virtual Result commit_snapshot (void) = 0;
@@ -66,6 +233,13 @@ struct Snapper::Session : Genode::Session
           & = "")
       = 0;
 
+  /**
+   * @brief Reads the payloads of the given range of keys of the opened
+   *        generation ahead, so restoring them does not wait for the
+   *        file system. Returns NoData if read-ahead is disabled.
+   */
+  virtual Result prefetch (Archive::ArchiveKey, Genode::uint64_t) = 0;
+
   virtual Result close_generation (void) = 0;
 
   virtual Result
@@ -79,11 +253,33 @@ struct Snapper::Session : Genode::Session
 
   GENODE_RPC (Rpc_dataspace, Genode::Dataspace_capability, _dataspace);
 
+  GENODE_RPC (Rpc_tx_cap, Genode::Capability<Tx>, _tx_cap);
+
   GENODE_RPC (Rpc_init_snapshot, Result, init_snapshot);
 
   GENODE_RPC (Rpc_take_snapshot, Result, _take_snapshot, Genode::size_t,
               Archive::ArchiveKey);
 
+  GENODE_RPC (Rpc_take_snapshots, Result, _take_snapshots, Genode::size_t);
+
+  GENODE_RPC (Rpc_probe_snapshot, Result, probe_snapshot, Genode::size_t,
+              Snapper::HASH, Archive::ArchiveKey);
+
+  GENODE_RPC (Rpc_discard, Result, discard, Archive::ArchiveKey);
+
+  GENODE_RPC (Rpc_attach_region, Result, attach_region,
+              Genode::Dataspace_capability);
+
+  GENODE_RPC (Rpc_take_snapshot_region, Result, take_snapshot_region,
+              Genode::off_t, Genode::size_t, Archive::ArchiveKey);
+
+  GENODE_RPC (Rpc_begin_snapshot, Result, begin_snapshot,
+              Archive::ArchiveKey);
+
+  GENODE_RPC (Rpc_append_snapshot, Result, _append_snapshot, Genode::size_t);
+
+  GENODE_RPC (Rpc_finish_snapshot, Result, finish_snapshot);
+
   GENODE_RPC (Rpc_commit_snapshot, Result, commit_snapshot);
 
   GENODE_RPC (
@@ -93,6 +289,15 @@ struct Snapper::Session : Genode::Session
   GENODE_RPC (Rpc_restore, Result, _restore, Genode::size_t,
               Archive::ArchiveKey);
 
+  GENODE_RPC (Rpc_restore_range, Result, _restore_range, Genode::size_t,
+              Genode::size_t, Archive::ArchiveKey);
+
+  GENODE_RPC (Rpc_restore_batch, Genode::size_t, _restore_batch,
+              Genode::size_t);
+
+  GENODE_RPC (Rpc_prefetch, Result, prefetch, Archive::ArchiveKey,
+              Genode::uint64_t);
+
   GENODE_RPC (Rpc_close_generation, Result, close_generation);
 
   GENODE_RPC (
@@ -103,14 +308,21 @@ struct Snapper::Session : Genode::Session
 
   GENODE_RPC (Rpc_purge_zombies, Result, purge_zombies);
 
-  GENODE_RPC_INTERFACE (Rpc_dataspace, Rpc_init_snapshot, Rpc_take_snapshot,
+  GENODE_RPC_INTERFACE (Rpc_dataspace, Rpc_tx_cap, Rpc_init_snapshot,
+                        Rpc_take_snapshot, Rpc_take_snapshots,
+                        Rpc_probe_snapshot, Rpc_discard, Rpc_attach_region,
+                        Rpc_take_snapshot_region, Rpc_begin_snapshot,
+                        Rpc_append_snapshot, Rpc_finish_snapshot,
                         Rpc_commit_snapshot, Rpc_open_generation, Rpc_restore,
+                        Rpc_restore_range, Rpc_restore_batch, Rpc_prefetch,
                         Rpc_close_generation, Rpc_purge, Rpc_purge_expired,
                         Rpc_purge_zombies);
 };
 
 struct Snapper::Session_component : Genode::Rpc_object<Session>
 {
+  Genode::Env &env;
+
   /**
    * @brief Session_component is a wrapper for the Snapper::Main object.
    */
@@ -121,31 +333,264 @@ struct Snapper::Session_component : Genode::Rpc_object<Session>
    */
   Genode::Attached_ram_dataspace ds;
 
+  /**
+   * @brief Size of the bulk buffer of the asynchronous snapshot queue.
+   */
+  const Genode::Number_of_bytes queue_bufsize;
+
+  /**
+   * @brief Bulk buffer and sink of the asynchronous snapshot queue.
+   *        Constructed by the first _tx_cap() call, so sessions which
+   *        never use the queue do not pay for it.
+   */
+  Genode::Constructible<Genode::Attached_ram_dataspace> tx_ds{};
+  Genode::Constructible<Packet_stream_tx::Rpc_object<Tx> > tx{};
+
+  Genode::Constructible<Genode::Signal_handler<Session_component> >
+      packet_handler{};
+
+  /**
+   * @brief Dataspace of the client attached by attach_region().
+   */
+  Genode::Constructible<Genode::Attached_dataspace> region{};
+
   Session_component () = delete;
   Session_component (Genode::Env &env, Snapper::Main &snapper,
-                     const Genode::Number_of_bytes bufsize)
-      : snapper (snapper), ds (env.ram (), env.rm (), bufsize)
+                     const Genode::Number_of_bytes bufsize,
+                     const Genode::Number_of_bytes queue_bufsize)
+      : env (env), snapper (snapper), ds (env.ram (), env.rm (), bufsize),
+        queue_bufsize (queue_bufsize)
   {
   }
 
+  /**
+   * @brief Takes a snapshot of each submitted packet and acknowledges
+   *        it with the result.
+   */
+  void
+  _handle_packets (void)
+  {
+    Tx::Sink &sink = *tx->sink ();
+
+    while (sink.packet_avail () && sink.ready_to_ack ())
+      {
+        Packet_descriptor packet = sink.get_packet ();
+        packet.result (InvalidState);
+
+        if (sink.packet_valid (packet) && packet.size ())
+          packet.result (snapper.take_snapshot (sink.packet_content (packet),
+                                                packet.size (), packet.key ()));
+
+        sink.acknowledge_packet (packet);
+      }
+
+    sink.wakeup ();
+  }
+
   Genode::Dataspace_capability
   _dataspace () override
   {
     return ds.cap ();
   }
 
+  Genode::Capability<Tx>
+  _tx_cap () override
+  {
+    if (!tx.constructed ())
+      {
+        tx_ds.construct (env.ram (), env.rm (), queue_bufsize);
+        tx.construct (env.rm (), tx_ds->cap (), env.ep ().rpc_ep ());
+
+        packet_handler.construct (env.ep (), *this,
+                                  &Session_component::_handle_packets);
+
+        tx->sigh_packet_avail (*packet_handler);
+        tx->sigh_ready_to_ack (*packet_handler);
+      }
+
+    return tx->cap ();
+  }
+
   Result
   _take_snapshot (Genode::size_t size, Archive::ArchiveKey identifier) override
   {
     return snapper.take_snapshot (ds.local_addr<void> (), size, identifier);
   }
 
+  Result
+  _take_snapshots (Genode::size_t count) override
+  {
+    enum
+    {
+      BATCH_SIZE = 64
+    };
+
+    char *buf = ds.local_addr<char> ();
+    Genode::size_t offset = 0;
+    bool valid = true;
+
+    Main::Snapshot_request requests[BATCH_SIZE];
+    Record *records[BATCH_SIZE];
+
+    // INFO The records are passed to the snapper in batches, so their
+    // payloads can be hashed in parallel.
+    for (Genode::size_t i = 0; i < count && valid;)
+      {
+        Genode::size_t batch = 0;
+
+        for (; i < count && batch < BATCH_SIZE; i++)
+          {
+            if (ds.size () - offset < sizeof (Record))
+              {
+                valid = false;
+                break;
+              }
+
+            Record &record = *reinterpret_cast<Record *> (buf + offset);
+
+            if (record.size > ds.size () - offset - sizeof (Record))
+              {
+                record.result = InvalidState;
+                valid = false;
+                break;
+              }
+
+            requests[batch] = { buf + offset + sizeof (Record), record.size,
+                                record.key, 0, InvalidState };
+            records[batch++] = &record;
+
+            offset += Genode::min (Record::space (record.size),
+                                   ds.size () - offset);
+          }
+
+        snapper.take_snapshots (requests, batch);
+
+        for (Genode::size_t j = 0; j < batch; j++)
+          records[j]->result = requests[j].result;
+      }
+
+    return valid ? Ok : InvalidState;
+  }
+
   Result
   _restore (Genode::size_t size, Archive::ArchiveKey identifier) override
   {
     return snapper.restore (ds.local_addr<void> (), size, identifier);
   }
 
+  Result
+  _restore_range (Genode::size_t offset, Genode::size_t length,
+                  Archive::ArchiveKey identifier) override
+  {
+    if (length > ds.size ())
+      return InvalidState;
+
+    return snapper.restore_range (ds.local_addr<void> (), offset, length,
+                                  identifier);
+  }
+
+  Result
+  probe_snapshot (Genode::size_t size, Snapper::HASH hash,
+                  Archive::ArchiveKey identifier) override
+  {
+    return snapper.probe_snapshot (size, hash, identifier);
+  }
+
+  Result
+  discard (Archive::ArchiveKey identifier) override
+  {
+    return snapper.discard (identifier);
+  }
+
+  Result
+  attach_region (Genode::Dataspace_capability region_ds) override
+  {
+    region.destruct ();
+
+    if (!region_ds.valid ())
+      return Ok;
+
+    try
+      {
+        region.construct (env.rm (), region_ds);
+      }
+    catch (...)
+      {
+        Genode::error ("failed to attach the dataspace of the client!");
+        return InvalidState;
+      }
+
+    return Ok;
+  }
+
+  Result
+  take_snapshot_region (Genode::off_t offset, Genode::size_t size,
+                        Archive::ArchiveKey identifier) override
+  {
+    if (!region.constructed () || offset < 0
+        || (Genode::size_t)offset > region->size ()
+        || size > region->size () - (Genode::size_t)offset)
+      return InvalidState;
+
+    return snapper.take_snapshot (region->local_addr<char> () + offset, size,
+                                  identifier);
+  }
+
+  Result
+  begin_snapshot (Archive::ArchiveKey identifier) override
+  {
+    return snapper.begin_snapshot (identifier);
+  }
+
+  Result
+  _append_snapshot (Genode::size_t size) override
+  {
+    if (size > ds.size ())
+      return InvalidState;
+
+    return snapper.append_snapshot (ds.local_addr<void> (), size);
+  }
+
+  Result
+  finish_snapshot (void) override
+  {
+    return snapper.finish_snapshot ();
+  }
+
+  Genode::size_t
+  _restore_batch (Genode::size_t count) override
+  {
+    char *buf = ds.local_addr<char> ();
+    Record *records = reinterpret_cast<Record *> (buf);
+
+    count = Genode::min (count, ds.size () / sizeof (Record));
+    Genode::size_t offset = Record::align (count * sizeof (Record));
+
+    for (Genode::size_t i = 0; i < count; i++)
+      {
+        Genode::size_t size = 0;
+        Genode::size_t left = ds.size () - Genode::min (offset, ds.size ());
+
+        Result res = snapper.restore (buf + offset, left, records[i].key, size);
+
+        // INFO The client resubmits the remaining keys, which then start
+        // at the beginning of the payload area. The first key is
+        // deferred as well if the table of the other keys took its
+        // room, the client then resubmits fewer keys. A payload that
+        // does not fit on its own is reported as NoData.
+        if (res == NoData && (i || count > 1))
+          return i;
+
+        records[i].result = res;
+        records[i].size = size;
+
+        if (res == Ok)
+          offset += Record::align (size);
+      }
+
+    return count;
+  }
+
   Result
   init_snapshot (void) override
   {
@@ -166,6 +611,12 @@ struct Snapper::Session_component : Genode::Rpc_object<Session>
     return snapper.open_generation (generation);
   }
 
+  Result
+  prefetch (Archive::ArchiveKey first, Genode::uint64_t count) override
+  {
+    return snapper.prefetch (first, count);
+  }
+
   Result
   close_generation (void) override
   {
@@ -201,15 +652,17 @@ protected:
   Session_component *
   _create_session (const char *) override
   {
-    return new (md_alloc ()) Session_component (env, snapper, bufsize);
+    return new (md_alloc ())
+        Session_component (env, snapper, bufsize, queue_bufsize);
   }
 
 public:
   Root_component (Genode::Env &env, Genode::Entrypoint &ep,
                   Genode::Allocator &md_alloc, Snapper::Main &snapper,
-                  const Genode::Number_of_bytes bufsize)
+                  const Genode::Number_of_bytes bufsize,
+                  const Genode::Number_of_bytes queue_bufsize)
       : Genode::Root_component<Session_component> (ep, md_alloc), env (env),
-        snapper (snapper), bufsize (bufsize)
+        snapper (snapper), bufsize (bufsize), queue_bufsize (queue_bufsize)
   {
     if (snapper.config.verbose)
       Genode::log ("root snapper component created");
@@ -219,6 +672,7 @@ private:
   Genode::Env &env;
   Snapper::Main &snapper;
   Genode::Number_of_bytes bufsize;
+  Genode::Number_of_bytes queue_bufsize;
 };
 
 #endif // __cplusplus
@@ -0,0 +1,91 @@
+#ifndef __TREE_HASH_H
+#define __TREE_HASH_H
+
+#include <base/allocator.h>
+
+#include "worker_pool.h"
+#include "xxhash32.h"
+
+namespace Snapper
+{
+  class Tree_hasher;
+
+  enum
+  {
+    /**
+     * @brief The size of the leaves of the tree hash.
+     */
+    TREE_LEAF_SIZE = 256 * 1024
+  };
+
+  /**
+   * @brief Tree hash of the data, hashed on the calling thread.
+   */
+  Genode::uint32_t tree_hash (const void *, Genode::uint64_t);
+
+  /**
+   * @brief Tree hash of the data, whose leaves are hashed by the
+   * worker pool. The leaf digests are allocated from the allocator.
+   */
+  Genode::uint32_t tree_hash (const void *, Genode::uint64_t, Worker_pool &,
+                              Genode::Allocator &);
+}
+
+/**
+ * @brief Two-level hash for large payloads. The data is split into
+ * leaves of TREE_LEAF_SIZE bytes, each leaf is hashed with xxhash32 and
+ * the root is the xxhash32 of the concatenated leaf digests. Unlike a
+ * plain xxhash32, the leaves can be hashed in parallel.
+ *
+ * Mirrors the interface of XXHash32, so data can be hashed as it is
+ * streamed.
+ */
+class Snapper::Tree_hasher
+{
+private:
+  XXHash32 _root{ 0 };
+  XXHash32 _leaf{ 0 };
+  Genode::uint64_t _leaf_fill = 0;
+
+  void
+  _finish_leaf (void)
+  {
+    Genode::uint32_t digest = _leaf.hash ();
+    _root.add (&digest, sizeof (digest));
+
+    _leaf = XXHash32 (0);
+    _leaf_fill = 0;
+  }
+
+public:
+  void
+  add (const void *input, Genode::uint64_t length)
+  {
+    const char *data = (const char *)input;
+
+    while (length)
+      {
+        Genode::uint64_t chunk
+            = Genode::min (length, (Genode::uint64_t)TREE_LEAF_SIZE - _leaf_fill);
+
+        _leaf.add (data, chunk);
+        _leaf_fill += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (_leaf_fill == TREE_LEAF_SIZE)
+          _finish_leaf ();
+      }
+  }
+
+  Genode::uint32_t
+  hash (void)
+  {
+    if (_leaf_fill)
+      _finish_leaf ();
+
+    return _root.hash ();
+  }
+};
+
+#endif // __TREE_HASH_H
@@ -0,0 +1,130 @@
+#ifndef __VFS_WRITER_H
+#define __VFS_WRITER_H
+
+#include <util/noncopyable.h>
+#include <util/string.h>
+#include <vfs/file_system.h>
+#include <vfs/simple_env.h>
+#include <vfs/vfs_handle.h>
+
+namespace Snapper
+{
+  class Vfs_writer;
+}
+
+/**
+ * @brief Writes several files at once through the asynchronous
+ * Vfs_handle interface, instead of one after the other like
+ * Genode::New_file. Each file is written from a gather list of byte
+ * ranges, which must stay valid until the file is complete (see
+ * wait()).
+ *
+ * The files are advanced as far as the file system allows, the
+ * entrypoint only blocks for I/O once none of them can make progress.
+ * Must only be used from the entrypoint.
+ */
+class Snapper::Vfs_writer : Genode::Noncopyable
+{
+public:
+  enum
+  {
+    MAX_FILES = 16,
+    MAX_RANGES = 2
+  };
+
+  typedef Genode::String<Vfs::MAX_PATH_LEN> Path;
+
+private:
+  struct File
+  {
+    enum State
+    {
+      FREE,
+      WRITE,
+      SYNC,
+      DONE,
+      FAILED
+    };
+
+    State state = FREE;
+    Path path{};
+    Vfs::Vfs_handle *handle = nullptr;
+
+    char const *start[MAX_RANGES]{};
+    Genode::size_t size[MAX_RANGES]{};
+    unsigned num_ranges = 0;
+
+    /**
+     * @brief The range being written and the bytes written of it.
+     */
+    unsigned range = 0;
+    Genode::size_t written = 0;
+
+    Vfs::file_size offset = 0;
+    bool sync_queued = false;
+
+    /**
+     * @brief Whether the file is created or truncated, instead of
+     * being written in place.
+     */
+    bool truncate = true;
+
+    /**
+     * @brief Whether the last write accepted no bytes. Another write
+     * without progress after the I/O was committed fails the file.
+     */
+    bool stalled = false;
+  };
+
+  Vfs::File_system &_root;
+  Vfs::Env::Io &_io;
+  Genode::Allocator &_alloc;
+
+  File _files[MAX_FILES];
+
+  bool _open (File &);
+
+  /**
+   * @brief Advances the file as far as possible without blocking.
+   * Returns true if the file made progress.
+   */
+  bool _advance (File &);
+
+  void _close (File &, File::State);
+
+  bool _submit (const Path &, Vfs::file_size, bool, char const *,
+                Genode::size_t, char const *, Genode::size_t);
+
+public:
+  Vfs_writer (Vfs::Simple_env &env)
+      : _root (env.root_dir ()), _io (env.io ()), _alloc (env.alloc ())
+  {
+  }
+
+  ~Vfs_writer ();
+
+  /**
+   * @brief Starts writing the concatenation of the ranges to the file
+   * at the absolute path, which is created or truncated. Returns false
+   * if MAX_FILES files are in flight already, or if the file cannot be
+   * opened.
+   */
+  bool submit (const Path &, char const *, Genode::size_t,
+               char const * = nullptr, Genode::size_t = 0);
+
+  /**
+   * @brief Starts overwriting the existing file at the absolute path
+   * with the range, from the given offset on. The rest of the file is
+   * left as is. Returns false like submit().
+   */
+  bool submit_at (const Path &, Vfs::file_size, char const *,
+                  Genode::size_t);
+
+  /**
+   * @brief Blocks until all submitted files are written and synced.
+   * Returns false if any of them failed.
+   */
+  bool wait (void);
+};
+
+#endif // __VFS_WRITER_H
@@ -0,0 +1,111 @@
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include <base/allocator.h>
+#include <base/env.h>
+#include <base/mutex.h>
+#include <base/semaphore.h>
+#include <base/thread.h>
+#include <util/interface.h>
+#include <util/noncopyable.h>
+
+namespace Snapper
+{
+  class Worker_pool;
+}
+
+/**
+ * @brief Pool of threads that process the items of a batch in
+ * parallel. The calling thread takes part in the batch and returns
+ * once all items are processed, hence a pool without workers simply
+ * processes the batch on the calling thread.
+ *
+ * The items must not touch the VFS, which is only safe to use from
+ * the entrypoint.
+ */
+class Snapper::Worker_pool : Genode::Noncopyable
+{
+public:
+  struct Work : Genode::Interface
+  {
+    virtual void process (Genode::size_t) = 0;
+  };
+
+private:
+  enum
+  {
+    STACK_SIZE = 16 * 1024
+  };
+
+  struct Worker : Genode::Thread
+  {
+    Worker_pool &pool;
+
+    Worker (Genode::Env &env, Worker_pool &pool)
+        : Genode::Thread (env, "snapper_worker", STACK_SIZE), pool (pool)
+    {
+    }
+
+    void entry () override;
+  };
+
+  Genode::Allocator &_alloc;
+
+  Worker **_workers = nullptr;
+  unsigned _count = 0;
+
+  Genode::Mutex _mutex{};
+  Genode::Semaphore _start{ 0 };
+  Genode::Semaphore _done{ 0 };
+
+  Work *_work = nullptr;
+  Genode::size_t _items = 0;
+  Genode::size_t _next = 0;
+  bool _exit = false;
+
+  /**
+   * @brief Processes the next item of the current batch. Returns false
+   * once all items were handed out.
+   */
+  bool _process_next (void);
+
+public:
+  Worker_pool (Genode::Env &, Genode::Allocator &, unsigned workers);
+  ~Worker_pool ();
+
+  /**
+   * @brief Calls work.process() for each item of [0, items).
+   */
+  void run (Work &, Genode::size_t items);
+
+  /**
+   * @brief Calls fn() for each item of [0, items).
+   */
+  template <typename FN>
+  void
+  for_each_item (Genode::size_t items, FN const &fn)
+  {
+    struct Fn_work : Work
+    {
+      FN const &fn;
+
+      Fn_work (FN const &fn) : fn (fn) {}
+
+      void
+      process (Genode::size_t item) override
+      {
+        fn (item);
+      }
+    } work (fn);
+
+    run (work, items);
+  }
+
+  unsigned
+  workers (void) const
+  {
+    return _count;
+  }
+};
+
+#endif // __WORKER_POOL_H
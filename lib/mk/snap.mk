@@ -1,4 +1,6 @@
-SRC_CC   = snapper.cc backlink.cc archive.cc utils.cc xxhash32.cc
+SRC_CC   = snapper.cc backlink.cc archive.cc arena.cc utils.cc xxhash32.cc \
+           buffer_pool.cc hash_engine.cc tree_hash.cc vfs_writer.cc \
+           worker_pool.cc
 LIBS    += base vfs
 
 INC_DIR += $(REP_DIR)/include
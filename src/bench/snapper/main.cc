@@ -1,7 +1,10 @@
 #include <base/component.h>
+#include <base/log.h>
+#include <trace/timestamp.h>
 #include <util/construct_at.h>
 #include <util/list.h>
 
+#include "hash_engine.h"
 #include "snapper_session/connection.h"
 
 #ifndef PAYLOAD_NUM
@@ -20,12 +23,80 @@ mb_to_bytes (unsigned mb)
 
 constexpr static unsigned PAYLOAD_SIZE_BYTES = mb_to_bytes (PAYLOAD_SIZE);
 
+/**
+ * @brief Compares hashing a payload and copying it afterwards with the
+ * fused copy_and_hash(), which is how payloads are staged when
+ * write_behind is set. Prints the cycles spent on PAYLOAD_NUM payloads
+ * of PAYLOAD_SIZE.
+ */
+static void
+bench_copy_and_hash (Genode::Heap &heap)
+{
+  char *src = (char *)heap.alloc (PAYLOAD_SIZE_BYTES);
+  char *dst = (char *)heap.alloc (PAYLOAD_SIZE_BYTES);
+
+  for (unsigned i = 0; i < PAYLOAD_SIZE_BYTES; i++)
+    src[i] = (char)(i * 31);
+
+  struct
+  {
+    Snapper::Hash_id id;
+    char const *name;
+  } const hashes[] = { { Snapper::Xxh32, "xxh32" },
+                       { Snapper::Crc32c, "crc32c" } };
+
+  for (auto const &hash : hashes)
+    {
+      // INFO Checks a single hash of each path outside of the timed
+      // loops, hashes accumulated over identical payloads would cancel
+      // out.
+      Genode::memset (dst, 0, PAYLOAD_SIZE_BYTES);
+
+      Genode::uint32_t const separate_hash
+          = Snapper::hash_data (hash.id, src, PAYLOAD_SIZE_BYTES);
+      Genode::uint32_t const fused_hash
+          = Snapper::copy_and_hash (hash.id, dst, src, PAYLOAD_SIZE_BYTES);
+
+      if (separate_hash != fused_hash
+          || Genode::memcmp (dst, src, PAYLOAD_SIZE_BYTES))
+        Genode::error ("copy_and_hash (", hash.name, ") mismatch");
+
+      // INFO Keeps the hashes of the timed loops alive.
+      Genode::uint32_t volatile sink = 0;
+
+      Genode::Trace::Timestamp start = Genode::Trace::timestamp ();
+
+      for (int i = 0; i < PAYLOAD_NUM; i++)
+        {
+          sink = Snapper::hash_data (hash.id, src, PAYLOAD_SIZE_BYTES);
+          Genode::memcpy (dst, src, PAYLOAD_SIZE_BYTES);
+        }
+
+      Genode::Trace::Timestamp separate = Genode::Trace::timestamp () - start;
+      start = Genode::Trace::timestamp ();
+
+      for (int i = 0; i < PAYLOAD_NUM; i++)
+        sink = Snapper::copy_and_hash (hash.id, dst, src, PAYLOAD_SIZE_BYTES);
+
+      Genode::Trace::Timestamp fused = Genode::Trace::timestamp () - start;
+      (void)sink;
+
+      Genode::log ("copy_and_hash (", hash.name, "): separate ", separate,
+                   " cycles, fused ", fused, " cycles");
+    }
+
+  heap.free (dst, PAYLOAD_SIZE_BYTES);
+  heap.free (src, PAYLOAD_SIZE_BYTES);
+}
+
 void
 Component::construct (Genode::Env &env)
 {
   Snapper::Connection snapper (env);
   Genode::Heap heap{ env.ram (), env.rm () };
 
+  bench_copy_and_hash (heap);
+
   (void)snapper.init_snapshot ();
 
   for (int i = 1; i <= PAYLOAD_NUM; i++)
@@ -6,63 +6,291 @@
 #include "xxhash32.h"
 #include "snapper.h"
 
+static Genode::uint64_t __next_spill_id = 0;
+
+/**
+ * @brief Removes every file of the spill directory.
+ */
+static void
+__remove_spill_files (Genode::Directory &snapper_root)
+{
+  if (!snapper_root.directory_exists ("/.spill"))
+    return;
+
+  Genode::Directory spill_dir (snapper_root, "/.spill");
+
+  auto count = [&] () {
+    Genode::uint64_t num = 0;
+    spill_dir.for_each_entry ([&num] (Genode::Directory::Entry &) { num++; });
+    return num;
+  };
+
+  // INFO Removing an entry shifts the ones after it, hence the
+  // directory is listed again until it is empty or nothing could be
+  // removed.
+  for (Genode::uint64_t left = count (); left;)
+    {
+      spill_dir.for_each_entry ([&] (Genode::Directory::Entry &entry) {
+        spill_dir.unlink (entry.name ());
+      });
+
+      Genode::uint64_t now_left = count ();
+
+      if (now_left >= left)
+        {
+          Genode::warning ("could not remove stale spill files!");
+          return;
+        }
+
+      left = now_left;
+    }
+}
+
 Snapper::Archive::Archive (Genode::Heap &heap, Genode::Directory &snapper_root,
-                           bool verbose)
-    : archive (), heap (heap), snapper_root (snapper_root), verbose (verbose)
+                           bool verbose, Genode::size_t budget)
+    : arena (heap), archive (heap), heap (heap), snapper_root (snapper_root),
+      verbose (verbose), budget (budget), partitions (heap),
+      spill_id (__next_spill_id++)
 {
+  // INFO Spill file names restart with every run. Files left over by
+  // a run that ended without destroying its archives are removed by
+  // the first archive, before any archive of this run could spill.
+  if (!spill_id)
+    __remove_spill_files (snapper_root);
 }
 
 Snapper::Archive::~Archive ()
 {
-  while (true)
+  archive.clear ();
+  total_backlinks = 0;
+
+  partitions.for_each ([this] (const Partition &partition) {
+    if (partition.spilled)
+      snapper_root.unlink (_spill_path (partition.name));
+  });
+
+  // INFO The backlink slots are returned to the heap all at once by
+  // the arena's destructor.
+}
+
+Snapper::Archive::Queue::~Queue ()
+{
+  // INFO The slots of a spilled queue were already released, only
+  // the count is kept.
+  if (!slots)
+    return;
+
+  for (Genode::uint32_t i = 0; i < count; i++)
+    slots[i].~Backlink ();
+
+  alloc.free (slots, capacity * sizeof (Backlink));
+}
+
+void
+Snapper::Archive::Queue::_grow (void)
+{
+  // INFO Most keys only ever have a single backlink, redundant copies
+  // are rare.
+  Genode::uint32_t new_capacity = capacity ? capacity * 2 : 1;
+
+  Backlink *new_slots
+      = (Backlink *)alloc.alloc (new_capacity * sizeof (Backlink));
+
+  // INFO Backlinks are not trivially copyable, hence they are copied
+  // into the new slots and destroyed in the old ones.
+  if (slots)
     {
-      bool not_empty = archive.with_any_element (
-          [this] (const Archive::ArchiveEntry &entry) {
-            remove (entry.name);
-          });
+      for (Genode::uint32_t i = 0; i < count; i++)
+        {
+          Genode::construct_at<Backlink> (new_slots + i, slots[i]);
+          slots[i].~Backlink ();
+        }
 
-      if (!not_empty)
-        break;
+      alloc.free (slots, capacity * sizeof (Backlink));
     }
 
-  total_backlinks = 0;
+  slots = new_slots;
+  capacity = new_capacity;
 }
 
 void
 Snapper::Archive::insert (const Archive::ArchiveKey key,
                           const Genode::String<Vfs::MAX_PATH_LEN> &val)
 {
-  Snapper::Archive::Backlink *backlink
-      = new (heap) Archive::Backlink (heap, snapper_root, verbose, val);
-
-  backlink->_self = backlink;
-
-  archive.with_element (
+  with_entry (
       key,
-      [backlink] (Archive::ArchiveEntry &entry) {
-        entry.queue.enqueue (*backlink);
+      [this, &val] (Archive::ArchiveEntry &entry) {
+        entry.queue.enqueue (heap, snapper_root, verbose, val);
+        touch (entry);
       },
-      [this, key, backlink] () {
-        Archive::ArchiveEntry *entry
-            = new (heap) Archive::ArchiveEntry (key, archive);
-
-        entry->_self = entry;
-
-        entry->queue.enqueue (*backlink);
+      [this, key, &val] () {
+        Archive::ArchiveEntry &entry = archive.insert (key, arena, epoch);
+        entry.queue.enqueue (heap, snapper_root, verbose, val);
       });
 
   total_backlinks++;
+  _enforce_budget (_partition (key));
 
   if (verbose)
     {
-      Genode::log ("archive entry inserted: ", key, " -> \"", backlink->value,
+      Genode::log ("archive entry inserted: ", key, " -> \"", val,
                    "\"");
     }
 }
 
-void
-Snapper::Archive::commit (Genode::Directory &dir,
-                          const Genode::String<Vfs::MAX_PATH_LEN> &file)
+/**
+ * @brief Size of the parent generation name stored in front of the
+ * key-value pairs of a delta file. The name is zero-padded.
+ */
+static constexpr Genode::size_t __delta_prefix_size
+    = Vfs::Directory_service::Dirent::Name::MAX_LEN;
+
+namespace
+{
+  /**
+   * @brief Buffer of a fixed size, released when it goes out of scope.
+   */
+  struct Chunk_buffer : Genode::Noncopyable
+  {
+    Genode::Allocator &alloc;
+    char *const start;
+    const Genode::size_t size;
+
+    Chunk_buffer (Genode::Allocator &alloc, Genode::size_t size)
+        : alloc (alloc), start ((char *)alloc.alloc (size)), size (size)
+    {
+    }
+
+    ~Chunk_buffer () { alloc.free (start, size); }
+  };
+
+  /**
+   * @brief Collects the pieces of a file in a buffer and passes the
+   * buffer to flush_fn() whenever the next piece does not fit. A piece
+   * must not be larger than the buffer.
+   */
+  template <typename FLUSH_FN> class Chunk_writer
+  {
+  private:
+    Chunk_buffer &_buf;
+    FLUSH_FN _flush_fn;
+
+    Genode::size_t _used = 0;
+    bool _ok = true;
+
+  public:
+    Chunk_writer (Chunk_buffer &buf, FLUSH_FN const &flush_fn)
+        : _buf (buf), _flush_fn (flush_fn)
+    {
+    }
+
+    void
+    add (const void *src, Genode::size_t size)
+    {
+      if (_used + size > _buf.size)
+        flush ();
+
+      Genode::memcpy (_buf.start + _used, src, size);
+      _used += size;
+    }
+
+    /**
+     * @brief Passes the collected pieces on. Returns false if this or
+     * any earlier flush_fn() failed.
+     */
+    bool
+    flush (void)
+    {
+      if (_used && _ok)
+        _ok = _flush_fn (_buf.start, _used);
+
+      _used = 0;
+      return _ok;
+    }
+  };
+
+  /**
+   * @brief Reads the first `length` bytes of a file through a buffer,
+   * piece by piece. A piece must not be larger than the buffer.
+   */
+  class Chunk_reader
+  {
+  private:
+    const Genode::Readonly_file &_file;
+    Chunk_buffer &_buf;
+
+    Genode::size_t _pos = 0;
+    Genode::size_t _end = 0;
+
+    Genode::uint64_t _offset = 0;
+    Genode::uint64_t _left;
+
+  public:
+    Chunk_reader (const Genode::Readonly_file &file, Chunk_buffer &buf,
+                  Genode::uint64_t length)
+        : _file (file), _buf (buf), _left (length)
+    {
+    }
+
+    /**
+     * @brief Returns the next piece, which is valid until the next
+     * call. Returns nullptr if the file is too short.
+     */
+    const char *
+    take (Genode::size_t size)
+    {
+      if (_end - _pos < size)
+        {
+          Genode::memmove (_buf.start, _buf.start + _pos, _end - _pos);
+          _end -= _pos;
+          _pos = 0;
+
+          Genode::Byte_range_ptr dst (
+              _buf.start + _end,
+              (Genode::size_t)Genode::min ((Genode::uint64_t)(_buf.size
+                                                              - _end),
+                                           _left));
+
+          Genode::size_t bytes_read
+              = dst.num_bytes
+                    ? _file.read (Genode::Readonly_file::At{ _offset }, dst)
+                    : 0;
+
+          _offset += bytes_read;
+          _left -= bytes_read;
+          _end += bytes_read;
+
+          if (_end - _pos < size)
+            return nullptr;
+        }
+
+      const char *piece = _buf.start + _pos;
+      _pos += size;
+
+      return piece;
+    }
+
+    bool
+    done (void) const
+    {
+      return _pos == _end && !_left;
+    }
+  };
+}
+
+/**
+ * @brief Helper to write an archive file. The data section consists of
+ * the prefix followed by the key-value records written by fn(), and is
+ * prepended with the Snapper version, the hash of the data section and
+ * the number of records. The data section is streamed through a buffer
+ * of `chunk_size` bytes, which must hold at least one record.
+ */
+static void
+__write_archive_file (Genode::Heap &heap, Genode::Directory &dir,
+                      const Genode::String<Vfs::MAX_PATH_LEN> &file,
+                      const Genode::Const_byte_range_ptr &prefix,
+                      decltype (Snapper::Archive::total_backlinks) num_records,
+                      Genode::size_t chunk_size, auto const &fn)
 {
   if (dir.file_exists (file))
     {
@@ -74,93 +302,201 @@ Snapper::Archive::commit (Genode::Directory &dir,
   try
     {
       Genode::New_file archive_file (dir, file);
+      Chunk_buffer chunk (heap, chunk_size);
 
-      constexpr Genode::size_t key_size = sizeof (Archive::ArchiveKey);
+      constexpr Genode::size_t key_size = sizeof (Snapper::Archive::ArchiveKey);
 
       constexpr Genode::size_t val_size
-          = sizeof (decltype (Archive::Backlink::value));
+          = sizeof (decltype (Snapper::Archive::Backlink::value));
 
-      constexpr Genode::size_t kv_pair_size = key_size + val_size;
+      auto stream = [&] (auto const &flush_fn) {
+        Chunk_writer writer (chunk, flush_fn);
 
-      const Genode::size_t archive_data_size = total_backlinks * kv_pair_size;
-      char *archive_data_buf = new (heap) char[archive_data_size];
+        writer.add (prefix.start, prefix.num_bytes);
 
-      Genode::uint64_t idx = 0;
+        fn ([&] (Snapper::Archive::ArchiveKey key, const char *val) {
+          writer.add (&key, key_size);
+          writer.add (val, val_size);
+        });
 
-      archive.for_each ([&] (const Archive::ArchiveEntry &entry) {
-        entry.queue.for_each ([archive_data_buf, &idx,
-                               &entry] (const Archive::Backlink &backlink) {
-          Genode::memcpy (archive_data_buf + (idx * kv_pair_size), &entry.name,
-                          key_size);
+        return writer.flush ();
+      };
 
-          Genode::memcpy (archive_data_buf + (idx * kv_pair_size + key_size),
-                          backlink.value.string (), val_size);
+      // INFO The hash precedes the records, hence they are streamed
+      // twice, once to hash and once to write them. Neither pass holds
+      // more than a chunk of them in memory.
+      XXHash32 hasher (0);
 
-          idx++;
-        });
+      stream ([&] (const char *start, Genode::size_t size) {
+        hasher.add (start, size);
+        return true;
       });
 
-      const Genode::size_t archive_buf_size
-          = sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
-            + sizeof (decltype (total_backlinks)) + archive_data_size;
+      char archive_header[sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
+                          + sizeof (num_records)];
 
-      if (archive_buf_size == 0) {
-          Genode::error ("archive has an invalid size!");
-          throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
-      }
+      Snapper::VERSION ver = Snapper::Version;
+      Snapper::HASH hash = hasher.hash ();
 
-      char *archive_buf = new (heap) char[archive_buf_size];
+      Genode::memcpy (archive_header, &ver, sizeof (Snapper::VERSION));
 
-      Snapper::VERSION ver = Version;
-      Snapper::HASH hash = xxhash32 (archive_data_buf, archive_data_size);
-
-      Genode::memcpy (archive_buf, &ver, sizeof (Snapper::VERSION));
-
-      Genode::memcpy (archive_buf + sizeof (Snapper::VERSION), &hash,
+      Genode::memcpy (archive_header + sizeof (Snapper::VERSION), &hash,
                       sizeof (Snapper::HASH));
 
-      Genode::memcpy (archive_buf + sizeof (Snapper::VERSION)
+      Genode::memcpy (archive_header + sizeof (Snapper::VERSION)
                           + sizeof (Snapper::HASH),
-                      &total_backlinks, sizeof (decltype (total_backlinks)));
-
-      Genode::memcpy (archive_buf + sizeof (Snapper::VERSION)
-                          + sizeof (Snapper::HASH)
-                          + sizeof (decltype (total_backlinks)),
-                      archive_data_buf, archive_data_size);
-
-      heap.free (archive_data_buf, archive_data_size);
-
-      Genode::New_file::Append_result res
-          = archive_file.append (archive_buf, archive_buf_size);
+                      &num_records, sizeof (num_records));
 
-      heap.free (archive_buf, archive_buf_size);
+      bool ok = archive_file.append (archive_header, sizeof (archive_header))
+                    == Genode::New_file::Append_result::OK
+                && stream ([&] (const char *start, Genode::size_t size) {
+                     return archive_file.append (start, size)
+                            == Genode::New_file::Append_result::OK;
+                   });
 
-      if (res != Genode::New_file::Append_result::OK)
+      if (!ok)
         {
           Genode::error ("failed to write to the archive file!");
-          throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+          throw Snapper::CrashStates::SNAPSHOT_NOT_POSSIBLE;
         }
     }
   catch (Genode::New_file::Create_failed)
     {
       Genode::error ("failed to create archive file!");
-      throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      throw Snapper::CrashStates::SNAPSHOT_NOT_POSSIBLE;
     }
   catch (Genode::Out_of_ram)
     {
       Genode::error ("snapper is out of RAM!");
-      throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      throw Snapper::CrashStates::SNAPSHOT_NOT_POSSIBLE;
     }
   catch (Genode::Out_of_caps)
     {
       Genode::error ("snapper is out of capabilities!");
-      throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      throw Snapper::CrashStates::SNAPSHOT_NOT_POSSIBLE;
     }
   catch (Genode::Denied)
     {
       Genode::error ("memory allocation denied!");
-      throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      throw Snapper::CrashStates::SNAPSHOT_NOT_POSSIBLE;
+    }
+}
+
+void
+Snapper::Archive::commit (Genode::Directory &dir,
+                          const Genode::String<Vfs::MAX_PATH_LEN> &file)
+{
+  __write_archive_file (
+      heap, dir, file, Genode::Const_byte_range_ptr (nullptr, 0),
+      total_backlinks, _chunk_size (), [this] (auto const &write_record) {
+        for_each_entry ([&] (const Archive::ArchiveEntry &entry) {
+          entry.queue.for_each ([&] (const Archive::Backlink &backlink) {
+            write_record (entry.name, backlink.value.string ());
+          });
+        });
+      });
+}
+
+void
+Snapper::Archive::commit_delta (
+    Genode::Directory &dir,
+    const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        &parent,
+    const Genode::String<Vfs::MAX_PATH_LEN> &file)
+{
+  // INFO A changed key without any backlinks is recorded with an
+  // empty value, which marks the key as removed.
+  decltype (total_backlinks) num_records = 0;
+
+  archive.for_each ([&] (const Archive::ArchiveEntry &entry) {
+    if (entry.epoch != epoch)
+      return;
+
+    num_records += entry.queue.empty () ? 1 : entry.queue.count;
+  });
+
+  const decltype (Backlink::value) removed;
+
+  // INFO The parent is stored as a zero-padded name of a fixed size,
+  // independent of the layout of Genode::String.
+  char parent_field[__delta_prefix_size]{};
+  Genode::copy_cstring (parent_field, parent.string (), sizeof (parent_field));
+
+  __write_archive_file (
+      heap, dir, file,
+      Genode::Const_byte_range_ptr (parent_field, sizeof (parent_field)),
+      num_records, _chunk_size (), [&] (auto const &write_record) {
+        archive.for_each ([&] (const Archive::ArchiveEntry &entry) {
+          if (entry.epoch != epoch)
+            return;
+
+          if (entry.queue.empty ())
+            {
+              write_record (entry.name, removed.string ());
+              return;
+            }
+
+          // INFO Only the partitions holding changed entries are
+          // paged in.
+          _make_resident (entry.name);
+
+          entry.queue.for_each ([&] (const Archive::Backlink &backlink) {
+            write_record (entry.name, backlink.value.string ());
+          });
+        });
+      });
+
+  if (verbose)
+    Genode::log ("delta archive committed: ", num_records, " of ",
+                 total_backlinks, " backlinks, parent: ", parent);
+}
+
+void
+Snapper::Archive::touch (Archive::ArchiveEntry &entry)
+{
+  entry.epoch = epoch;
+}
+
+void
+Snapper::Archive::mark_submitted (Archive::ArchiveEntry &entry)
+{
+  entry.submitted = epoch;
+}
+
+void
+Snapper::Archive::link (Archive::ArchiveEntry &entry)
+{
+  if (entry.linked != epoch)
+    {
+      entry.linked = epoch;
+      entry.links = 0;
     }
+
+  entry.links++;
+}
+
+Genode::uint32_t
+Snapper::Archive::links (const Archive::ArchiveEntry &entry) const
+{
+  return entry.linked == epoch ? entry.links : 0;
+}
+
+void
+Snapper::Archive::seal (void)
+{
+  // INFO Entries without backlinks hold no backlinks to subtract from
+  // total_backlinks.
+  archive.remove_if ([this] (const Archive::ArchiveEntry &entry) {
+    if (!entry.queue.empty ())
+      return false;
+
+    if (verbose)
+      Genode::log ("archive entry removed: ", entry.name);
+
+    return true;
+  });
+
+  epoch++;
 }
 
 void
@@ -169,12 +505,7 @@ Snapper::Archive::remove (const ArchiveKey key)
   archive.with_element (
       key,
       [this] (Archive::ArchiveEntry &entry) {
-        entry.queue.for_each ([this] (Archive::Backlink &backlink) {
-          total_backlinks--;
-          Genode::destroy (heap, backlink._self);
-        });
-
-        Genode::destroy (heap, entry._self);
+        total_backlinks -= entry.queue.count;
       },
       [this, key] () {
         if (verbose)
@@ -183,19 +514,265 @@ Snapper::Archive::remove (const ArchiveKey key)
           }
       });
 
+  archive.remove (key);
+
   if (verbose)
     {
       Genode::log ("archive entry removed: ", key);
     }
 }
 
+/**
+ * @brief Size of the key and the number of backlinks stored in front of
+ * the values of each entry in a spill file.
+ */
+static constexpr Genode::size_t __spill_header_size
+    = sizeof (Snapper::Archive::ArchiveKey) + sizeof (Genode::uint32_t);
+
+Genode::size_t
+Snapper::Archive::_chunk_size (void) const
+{
+  Genode::size_t size
+      = budget ? Genode::min (budget / 4, (Genode::size_t)IO_CHUNK)
+               : (Genode::size_t)IO_CHUNK;
+
+  return Genode::max (size, Index::RECORD_SIZE);
+}
+
+Genode::String<Vfs::MAX_PATH_LEN>
+Snapper::Archive::_spill_path (Genode::uint64_t partition) const
+{
+  return Genode::String<Vfs::MAX_PATH_LEN> ("/.spill/", spill_id, "-",
+                                            partition);
+}
+
+void
+Snapper::Archive::_make_resident (const ArchiveKey key)
+{
+  if (!budget)
+    return;
+
+  Genode::uint64_t id = _partition (key);
+  bool paged_in = false;
+
+  partitions.with_element (
+      id,
+      [&] (Partition &partition) {
+        partition.last_use = ++clock;
+
+        if (partition.spilled)
+          {
+            _page_in (partition);
+            paged_in = true;
+          }
+      },
+      [&] () { partitions.insert (id, id).last_use = ++clock; });
+
+  if (paged_in)
+    _enforce_budget (id);
+}
+
+void
+Snapper::Archive::_enforce_budget (Genode::uint64_t pinned)
+{
+  if (!budget || spill_failed)
+    return;
+
+  while (arena.in_use () > budget)
+    {
+      bool found = false;
+      Genode::uint64_t victim = 0;
+      Genode::uint64_t oldest = 0;
+
+      partitions.for_each ([&] (const Partition &partition) {
+        if (partition.spilled || partition.name == pinned)
+          return;
+
+        if (!found || partition.last_use < oldest)
+          {
+            victim = partition.name;
+            oldest = partition.last_use;
+            found = true;
+          }
+      });
+
+      if (!found)
+        return;
+
+      partitions.with_element (
+          victim,
+          [&] (Partition &partition) {
+            if (!_spill (partition))
+              {
+                Genode::warning ("failed to spill archive partition ",
+                                 partition.name,
+                                 ", keeping the archive in memory!");
+                spill_failed = true;
+              }
+          },
+          [] () {});
+
+      if (spill_failed)
+        return;
+    }
+}
+
+bool
+Snapper::Archive::_spill (Partition &partition)
+{
+  const ArchiveKey first = partition.name * PARTITION_KEYS;
+  const ArchiveKey last = first + PARTITION_KEYS - 1;
+
+  constexpr Genode::size_t val_size = sizeof (decltype (Backlink::value));
+
+  Genode::size_t size = 0;
+
+  archive.for_each_in_range (first, last, [&] (ArchiveEntry &entry) {
+    size += __spill_header_size + entry.queue.count * val_size;
+  });
+
+  if (size)
+    {
+      try
+        {
+          if (!snapper_root.directory_exists ("/.spill"))
+            snapper_root.create_sub_directory ("/.spill");
+
+          Genode::New_file spill_file (snapper_root,
+                                       _spill_path (partition.name));
+
+          // INFO Spilling happens when memory is short, hence the
+          // partition is streamed through a chunk of a fixed size.
+          Chunk_buffer chunk (heap, _chunk_size ());
+          Chunk_writer writer (chunk, [&] (const char *start,
+                                           Genode::size_t num_bytes) {
+            return spill_file.append (start, num_bytes)
+                   == Genode::New_file::Append_result::OK;
+          });
+
+          archive.for_each_in_range (first, last, [&] (ArchiveEntry &entry) {
+            writer.add (&entry.name, sizeof (entry.name));
+            writer.add (&entry.queue.count, sizeof (entry.queue.count));
+
+            entry.queue.for_each ([&] (const Backlink &backlink) {
+              writer.add (backlink.value.string (), val_size);
+            });
+          });
+
+          if (!writer.flush ())
+            return false;
+        }
+      catch (...)
+        {
+          return false;
+        }
+    }
+
+  // INFO The entries themselves stay in the archive, so the number of
+  // backlinks of a spilled entry is still known.
+  archive.for_each_in_range (first, last, [&] (ArchiveEntry &entry) {
+    Queue &queue = entry.queue;
+
+    if (!queue.slots)
+      return;
+
+    for (Genode::uint32_t i = 0; i < queue.count; i++)
+      queue.slots[i].~Backlink ();
+
+    arena.free (queue.slots, queue.capacity * sizeof (Backlink));
+    queue.slots = nullptr;
+    queue.capacity = 0;
+  });
+
+  partition.spilled = true;
+  partition.size = size;
+
+  if (verbose)
+    Genode::log ("archive partition spilled: ", partition.name, " (", size,
+                 " bytes)");
+
+  return true;
+}
+
+void
+Snapper::Archive::_page_in (Partition &partition)
+{
+  constexpr Genode::size_t val_size = sizeof (decltype (Backlink::value));
+
+  const Genode::String<Vfs::MAX_PATH_LEN> path = _spill_path (partition.name);
+
+  if (partition.size)
+    {
+      try
+        {
+          Genode::Readonly_file spill_file (snapper_root, path);
+          Chunk_buffer chunk (heap, _chunk_size ());
+          Chunk_reader reader (spill_file, chunk, partition.size);
+
+          while (!reader.done ())
+            {
+              const char *header = reader.take (__spill_header_size);
+              if (!header)
+                throw Snapper::CrashStates::INVALID_ARCHIVE_ENTRY;
+
+              ArchiveKey key;
+              Genode::uint32_t count;
+
+              Genode::memcpy (&key, header, sizeof (key));
+              Genode::memcpy (&count, header + sizeof (key), sizeof (count));
+
+              // INFO Entries removed while the partition was spilled
+              // are skipped, no entries are added to a spilled
+              // partition. Enqueueing does not move the entries.
+              Queue *queue = nullptr;
+
+              archive.with_element (
+                  key,
+                  [&] (ArchiveEntry &entry) {
+                    if (entry.queue.slots)
+                      return;
+
+                    entry.queue.count = 0;
+                    queue = &entry.queue;
+                  },
+                  [] () {});
+
+              for (Genode::uint32_t i = 0; i < count; i++)
+                {
+                  const char *val = reader.take (val_size);
+                  if (!val)
+                    throw Snapper::CrashStates::INVALID_ARCHIVE_ENTRY;
+
+                  if (queue)
+                    queue->enqueue (heap, snapper_root, verbose,
+                                    Genode::Cstring (val, val_size));
+                }
+            }
+        }
+      catch (...)
+        {
+          Genode::error ("failed to page in archive partition ",
+                         partition.name, "!");
+          throw Snapper::CrashStates::INVALID_ARCHIVE_ENTRY;
+        }
+    }
+
+  snapper_root.unlink (path);
+
+  partition.spilled = false;
+  partition.size = 0;
+
+  if (verbose)
+    Genode::log ("archive partition paged in: ", partition.name);
+}
+
 /**
  * @brief Helper interator to go through each key-value pair in an
  * archive file and perform an operation fn().
  */
 static void
 __for_each_pair_in_archive_file (const Genode::Readonly_file &archive_file,
-                                 auto const &fn)
+                                 bool delta, auto const &fn)
 {
   Genode::Readonly_file::At pos{ sizeof (Snapper::VERSION)
                                  + sizeof (Snapper::HASH) };
@@ -213,6 +790,9 @@ __for_each_pair_in_archive_file (const Genode::Readonly_file &archive_file,
 
   pos.value += sizeof (decltype (Snapper::Archive::total_backlinks));
 
+  if (delta)
+    pos.value += __delta_prefix_size;
+
   decltype (Snapper::Archive::total_backlinks) num_backlinks
       = *(reinterpret_cast<decltype (Snapper::Archive::total_backlinks) *> (
           _num_backlinks_buf));
@@ -257,15 +837,63 @@ Snapper::Archive::extract_from_archive_file (
     const Genode::Readonly_file &archive_file)
 {
   __for_each_pair_in_archive_file (
-      archive_file,
+      archive_file, false,
       [this] (ArchiveKey key, const decltype (Archive::Backlink::value)
                                   & val) { insert (key, val); });
 }
 
+void
+Snapper::Archive::extract_from_delta_file (
+    const Genode::Readonly_file &delta_file)
+{
+  // INFO The records of a key are stored consecutively, hence the old
+  // backlinks only need to be dropped when a new key is encountered.
+  bool first = true;
+  ArchiveKey last_key = 0;
+
+  __for_each_pair_in_archive_file (
+      delta_file, true,
+      [&] (ArchiveKey key, const decltype (Archive::Backlink::value) & val) {
+        if (first || key != last_key)
+          {
+            if (archive.exists (key))
+              remove (key);
+
+            first = false;
+            last_key = key;
+          }
+
+        if (val != "")
+          insert (key, val);
+      });
+}
+
+Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+Snapper::Archive::delta_file_parent (const Genode::Readonly_file &delta_file)
+{
+  Genode::Readonly_file::At pos{
+    sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
+    + sizeof (decltype (Snapper::Archive::total_backlinks))
+  };
+
+  char _parent_buf[__delta_prefix_size];
+  Genode::Byte_range_ptr parent_buf (_parent_buf, sizeof (_parent_buf));
+
+  if (delta_file.read (pos, parent_buf) != parent_buf.num_bytes)
+    {
+      Genode::error ("invalid delta file: missing parent generation!");
+      throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+    }
+
+  _parent_buf[sizeof (_parent_buf) - 1] = 0;
+
+  return Genode::Cstring (_parent_buf);
+}
+
 bool
 Snapper::Archive::archive_file_contains_backlink (
     const Genode::Readonly_file &archive_file,
-    const decltype (Backlink::value) & search_val)
+    const decltype (Backlink::value) & search_val, bool delta)
 {
   Genode::Readonly_file::At pos{ sizeof (Snapper::VERSION)
                                  + sizeof (Snapper::HASH) };
@@ -283,6 +911,9 @@ Snapper::Archive::archive_file_contains_backlink (
 
   pos.value += sizeof (decltype (Snapper::Archive::total_backlinks));
 
+  if (delta)
+    pos.value += __delta_prefix_size;
+
   decltype (Snapper::Archive::total_backlinks) num_backlinks
       = *(reinterpret_cast<decltype (Snapper::Archive::total_backlinks) *> (
           _num_backlinks_buf));
@@ -316,3 +947,158 @@ Snapper::Archive::archive_file_contains_backlink (
 
   return false;
 }
+
+Snapper::Archive::Index::Index (Genode::Heap &heap,
+                                Genode::Directory &snapper_root,
+                                const Genode::String<Vfs::MAX_PATH_LEN> &path,
+                                bool delta, Genode::uint64_t stride)
+    : heap (heap), file (snapper_root, path), delta (delta),
+      stride (stride ? stride : 1)
+{
+  Genode::Readonly_file::At pos{ sizeof (Snapper::VERSION)
+                                 + sizeof (Snapper::HASH) };
+
+  char _num_records_buf[sizeof (num_records)];
+  Genode::Byte_range_ptr num_records_buf (_num_records_buf,
+                                          sizeof (_num_records_buf));
+
+  if (file.read (pos, num_records_buf) != num_records_buf.num_bytes)
+    {
+      Genode::error ("missing number of backlinks in the archive file");
+      throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+    }
+
+  num_records = *(reinterpret_cast<decltype (num_records) *> (
+      _num_records_buf));
+
+  data_offset = sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
+                + sizeof (num_records)
+                + (delta ? __delta_prefix_size : 0);
+
+  // INFO The number of records is read from the file, hence it is
+  // checked against the file size before anything is allocated for
+  // it.
+  Vfs::file_size file_size = snapper_root.file_size (path);
+
+  if (file_size < data_offset
+      || num_records > (file_size - data_offset) / RECORD_SIZE)
+    {
+      Genode::error ("invalid archive file: ", num_records,
+                     " records do not fit into ", file_size, " bytes!");
+      throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+    }
+
+  num_keys = (num_records + this->stride - 1) / this->stride;
+
+  // INFO The destructor does not run for a partially constructed
+  // index, hence the allocations are released before rethrowing.
+  try
+    {
+      block = (char *)heap.alloc (this->stride * RECORD_SIZE);
+
+      if (num_keys)
+        keys = (ArchiveKey *)heap.alloc (num_keys * sizeof (ArchiveKey));
+
+      char _key_buf[KEY_SIZE];
+      Genode::Byte_range_ptr key_buf (_key_buf, sizeof (_key_buf));
+
+      for (Genode::uint64_t i = 0; i < num_keys; i++)
+        {
+          pos.value = data_offset + i * this->stride * RECORD_SIZE;
+
+          if (file.read (pos, key_buf) != key_buf.num_bytes)
+            {
+              Genode::error ("invalid archive file: invalid key size!");
+              throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+            }
+
+          keys[i] = *(reinterpret_cast<ArchiveKey *> (key_buf.start));
+
+          // INFO The lookup relies on the records being sorted by key,
+          // which Archive::commit() guarantees.
+          if (i && keys[i] < keys[i - 1])
+            {
+              Genode::error ("invalid archive file: records are not sorted!");
+              throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+            }
+        }
+    }
+  catch (...)
+    {
+      _release ();
+      throw;
+    }
+}
+
+Snapper::Archive::Index::~Index ()
+{
+  _release ();
+}
+
+void
+Snapper::Archive::Index::_release (void)
+{
+  if (keys)
+    heap.free (keys, num_keys * sizeof (ArchiveKey));
+
+  if (block)
+    heap.free (block, stride * RECORD_SIZE);
+
+  if (parent)
+    Genode::destroy (heap, parent);
+
+  keys = nullptr;
+  block = nullptr;
+  parent = nullptr;
+}
+
+Genode::uint64_t
+Snapper::Archive::Index::_lower_bound (const ArchiveKey key)
+{
+  // INFO Find the first indexed key that is not lower than the key.
+  // The records of the key may start at the end of the preceding
+  // block.
+  Genode::uint64_t lo = 0;
+  Genode::uint64_t hi = num_keys;
+
+  while (lo < hi)
+    {
+      Genode::uint64_t mid = lo + (hi - lo) / 2;
+
+      if (keys[mid] < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo ? (lo - 1) * stride : 0;
+}
+
+const char *
+Snapper::Archive::Index::_record (Genode::uint64_t i, ArchiveKey &key)
+{
+  Genode::uint64_t idx = i / stride;
+
+  if (idx != block_idx)
+    {
+      Genode::uint64_t first = idx * stride;
+      Genode::uint64_t count = Genode::min (stride, num_records - first);
+
+      Genode::Readonly_file::At pos{ data_offset + first * RECORD_SIZE };
+      Genode::Byte_range_ptr block_buf (block, count * RECORD_SIZE);
+
+      if (file.read (pos, block_buf) != block_buf.num_bytes)
+        {
+          block_idx = ~0ULL;
+          Genode::error ("invalid archive file: truncated records!");
+          throw Snapper::CrashStates::INVALID_ARCHIVE_FILE;
+        }
+
+      block_idx = idx;
+    }
+
+  const char *record = block + (i - idx * stride) * RECORD_SIZE;
+  key = *(reinterpret_cast<const ArchiveKey *> (record));
+
+  return record + KEY_SIZE;
+}
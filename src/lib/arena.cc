@@ -0,0 +1,107 @@
+#include "arena.h"
+
+Snapper::Arena::Size_class *
+Snapper::Arena::_size_class (Genode::size_t size, bool create)
+{
+  for (Size_class &size_class : _classes)
+    {
+      if (size_class.size == size)
+        return &size_class;
+
+      if (!size_class.size && create)
+        {
+          size_class.size = size;
+          return &size_class;
+        }
+    }
+
+  return nullptr;
+}
+
+char *
+Snapper::Arena::_new_chunk (Genode::size_t size)
+{
+  Genode::size_t chunk_size = _align (sizeof (Chunk)) + size;
+
+  Chunk *chunk = (Chunk *)_backing.alloc (chunk_size);
+  chunk->next = _chunks;
+  chunk->size = chunk_size;
+
+  _chunks = chunk;
+  _consumed += chunk_size;
+
+  return (char *)chunk + _align (sizeof (Chunk));
+}
+
+void *
+Snapper::Arena::alloc (Genode::size_t size)
+{
+  size = _align (Genode::max (size, sizeof (Free_block)));
+  _in_use += size;
+
+  Size_class *size_class = _size_class (size, false);
+  if (size_class && size_class->head)
+    {
+      Free_block *block = size_class->head;
+      size_class->head = block->next;
+
+      return block;
+    }
+
+  // INFO Oversized allocations get a chunk of their own, so the
+  // remainder of the current chunk is not wasted.
+  if (size > CHUNK_SIZE / 4)
+    return _new_chunk (size);
+
+  if (size > _left)
+    {
+      _pos = _new_chunk (CHUNK_SIZE);
+      _left = CHUNK_SIZE;
+    }
+
+  void *addr = _pos;
+  _pos += size;
+  _left -= size;
+
+  return addr;
+}
+
+void
+Snapper::Arena::free (void *addr, Genode::size_t size)
+{
+  if (!addr)
+    return;
+
+  size = _align (Genode::max (size, sizeof (Free_block)));
+  _in_use -= Genode::min (size, _in_use);
+
+  // INFO If all size classes are taken the block is only reclaimed by
+  // release().
+  Size_class *size_class = _size_class (size, true);
+  if (!size_class)
+    return;
+
+  Free_block *block = (Free_block *)addr;
+  block->next = size_class->head;
+  size_class->head = block;
+}
+
+void
+Snapper::Arena::release (void)
+{
+  while (_chunks)
+    {
+      Chunk *chunk = _chunks;
+      _chunks = chunk->next;
+
+      _backing.free (chunk, chunk->size);
+    }
+
+  for (Size_class &size_class : _classes)
+    size_class = Size_class{ 0, nullptr };
+
+  _pos = nullptr;
+  _left = 0;
+  _consumed = 0;
+  _in_use = 0;
+}
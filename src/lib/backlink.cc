@@ -171,10 +171,13 @@ namespace Snapper
     // to return the data buffer.
     Snapper::Archive::Backlink::Error err = None;
     Snapper::HASH hash = 0;
+    Snapper::VERSION version = 0;
 
     get_version ().with_result (
         [&] (Snapper::VERSION ver) {
-          if (ver != Snapper::Version)
+          version = ver;
+
+          if (format_version (ver) != Snapper::Version)
             {
               if (verbose)
                 Genode::warning ("backlink has a wrong version: ", value);
@@ -244,7 +247,7 @@ namespace Snapper
         return OpenErr;
       }
 
-    if (xxhash32 (data.start, data.num_bytes) != hash)
+    if (payload_hash (version, data.start, data.num_bytes) != hash)
       {
         if (verbose)
           Genode::warning ("backlink has an invalid HASH: ", value,
@@ -258,135 +261,181 @@ namespace Snapper
     return None;
   }
 
-  Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error>
-  Snapper::Archive::Backlink::set_reference_count (
-      const Snapper::RC reference_count)
+  Snapper::Archive::Backlink::Error
+  Snapper::Archive::Backlink::get_data_range (Genode::Byte_range_ptr &data,
+                                              Genode::size_t offset)
   {
-    Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error> res (
-        reference_count);
+    Snapper::Archive::Backlink::Error err = None;
 
-    Snapper::VERSION version = 0;
-    Snapper::HASH hash = 0;
+    get_data_size ().with_result (
+        [&] (Genode::size_t size) {
+          if (offset > size || data.num_bytes > size - offset)
+            err = InsufficientSizeErr;
+        },
+        [&] (Snapper::Archive::Backlink::Error e) { err = e; });
 
-    get_version ().with_result (
-        [&version] (Snapper::VERSION _version) { version = _version; },
-        [&res] (Snapper::Archive::Backlink::Error err) {
-          res = Genode::Attempt<Snapper::RC,
-                                Snapper::Archive::Backlink::Error> (err);
-        });
+    if (err != None)
+      return err;
 
-    if (res.failed ())
+    try
       {
-        Genode::error ("couldn't update the reference count of: ", value);
-        return res;
-      }
-
-    get_integrity ().with_result (
-        [&hash] (Snapper::HASH _hash) { hash = _hash; },
-        [&res] (Snapper::Archive::Backlink::Error err) {
-          res = Genode::Attempt<Snapper::RC,
-                                Snapper::Archive::Backlink::Error> (err);
-        });
+        Genode::Readonly_file reader (snapper_root, value);
+        Genode::Readonly_file::At pos{ sizeof (Snapper::VERSION)
+                                       + sizeof (Snapper::HASH)
+                                       + sizeof (Snapper::RC) + offset };
 
-    if (res.failed ())
+        if (reader.read (pos, data) != data.num_bytes)
+          {
+            Genode::error ("backlink missing data: ", value);
+            return MissingFieldErr;
+          }
+      }
+    catch (Genode::Readonly_file::Open_failed)
       {
-        Genode::error ("couldn't update the reference count of: ", value);
-        return res;
+        Genode::error ("could not open backlink: ", value);
+        return OpenErr;
       }
 
-    Genode::size_t data_size;
+    return None;
+  }
 
-    get_data_size ().with_result (
-        [&data_size] (Genode::size_t size) { data_size = size; },
-        [&res] (Snapper::Archive::Backlink::Error err) {
-          res = Genode::Attempt<Snapper::RC,
-                                Snapper::Archive::Backlink::Error> (err);
-        });
+  Snapper::Archive::Backlink::Error
+  Snapper::Archive::Backlink::verify_data (Buffer_pool &buffers)
+  {
+    Snapper::HASH hash = 0;
+    Snapper::VERSION version = 0;
+    Genode::size_t size = 0;
+    Snapper::Archive::Backlink::Error err = None;
 
-    if (res.failed ())
-      {
-        Genode::error ("couldn't update the reference count of: ", value);
-        return res;
-      }
+    get_version ().with_result (
+        [&] (Snapper::VERSION ver) {
+          version = ver;
 
-    char *_data_buf = (char *)heap.alloc (data_size);
-    Genode::Byte_range_ptr data (_data_buf, data_size);
+          if (format_version (ver) != Snapper::Version)
+            err = InvalidVersion;
+        },
+        [&] (auto) { err = InvalidVersion; });
 
-    Snapper::Archive::Backlink::Error err = get_data (data);
     if (err != None)
-      {
-        res = Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error> (
-            err);
+      return err;
 
-        goto CLEAN_RET;
-      }
+    get_integrity ().with_result (
+        [&] (Snapper::HASH _hash) { hash = _hash; },
+        [&] (Snapper::Archive::Backlink::Error) { err = InvalidIntegrity; });
 
-    try
-      {
-        // INFO Genode::Append_file overwrites the file contents.
-        Genode::Append_file writer (snapper_root, value);
+    if (err != None)
+      return err;
 
-        Genode::size_t _buf_size = sizeof (Snapper::VERSION)
-                                   + sizeof (Snapper::HASH)
-                                   + sizeof (Snapper::RC) + data.num_bytes;
+    get_data_size ().with_result (
+        [&] (Genode::size_t _size) { size = _size; },
+        [&] (Snapper::Archive::Backlink::Error e) { err = e; });
 
-        char *_buf = new (heap) char[_buf_size];
+    if (err != None)
+      return err;
 
-        Genode::memcpy (_buf, (char *)&version, sizeof (Snapper::VERSION));
+    Genode::size_t chunk_size = Genode::min (size, (Genode::size_t)VERIFY_CHUNK);
 
-        Genode::memcpy (_buf + sizeof (Snapper::VERSION), (char *)&hash,
-                        sizeof (Snapper::HASH));
+    Hasher hasher (hash_id (version));
 
-        Genode::memcpy (_buf + sizeof (Snapper::VERSION)
-                            + sizeof (Snapper::HASH),
-                        (char *)&reference_count, sizeof (Snapper::RC));
+    buffers.with_buffer (chunk_size, [&] (Genode::Byte_range_ptr &chunk) {
+      try
+        {
+          Genode::Readonly_file reader (snapper_root, value);
+          Genode::size_t offset = 0;
 
-        Genode::memcpy (_buf + sizeof (Snapper::VERSION)
-                            + sizeof (Snapper::HASH) + sizeof (Snapper::RC),
-                        data.start, data.num_bytes);
+          while (offset < size)
+            {
+              Genode::Byte_range_ptr buf (
+                  chunk.start, Genode::min (chunk_size, size - offset));
 
-        Genode::New_file::Append_result write_res
-            = writer.append (_buf, _buf_size);
+              Genode::size_t bytes_read = reader.read (
+                  Genode::Readonly_file::At{ sizeof (Snapper::VERSION)
+                                             + sizeof (Snapper::HASH)
+                                             + sizeof (Snapper::RC) + offset },
+                  buf);
 
-        heap.free (_buf, _buf_size);
+              if (!bytes_read)
+                {
+                  Genode::error ("backlink missing data: ", value);
+                  err = MissingFieldErr;
+                  break;
+                }
 
-        if (write_res != Genode::Append_file::Append_result::OK)
-          {
-            res = Genode::Attempt<Snapper::RC,
-                                  Snapper::Archive::Backlink::Error> (
-                WriteErr);
+              hasher.add (chunk.start, bytes_read);
 
-            goto CLEAN_RET;
-          }
-      }
-    catch (Genode::Append_file::Create_failed)
+              offset += bytes_read;
+            }
+        }
+      catch (Genode::Readonly_file::Open_failed)
+        {
+          Genode::error ("could not open backlink: ", value);
+          err = OpenErr;
+        }
+    });
+
+    if (err == None && hasher.hash () != hash)
       {
-        res = Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error> (
-            OpenErr);
+        if (verbose)
+          Genode::warning ("backlink has an invalid HASH: ", value,
+                           "! Remove it to "
+                           "not receive this warning again.");
 
-        goto CLEAN_RET;
+        err = InvalidIntegrity;
       }
 
-  CLEAN_RET:
-    if (data.start)
-      heap.free (data.start, data.num_bytes);
+    return err;
+  }
+
+  Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error>
+  Snapper::Archive::Backlink::write_reference_count (
+      const Snapper::RC reference_count, Vfs_writer &writer)
+  {
+    Snapper::VERSION version = 0;
+    Snapper::Archive::Backlink::Error err = None;
+
+    get_version ().with_result (
+        [&version] (Snapper::VERSION _version) { version = _version; },
+        [&err] (Snapper::Archive::Backlink::Error e) { err = e; });
+
+    // INFO The offset of the reference count is only known for the
+    // current format.
+    if (err == None && format_version (version) != Version)
+      err = InvalidVersion;
 
-    if (res == WriteErr)
+    if (err != None)
+      {
+        Genode::error ("couldn't update the reference count of: ", value);
+        return Genode::Attempt<Snapper::RC,
+                               Snapper::Archive::Backlink::Error> (err);
+      }
+
+    // INFO Only the reference count is overwritten, the rest of the
+    // file is neither read nor written.
+    if (!writer.submit_at (Vfs_writer::Path ("/", value),
+                           sizeof (Snapper::VERSION) + sizeof (Snapper::HASH),
+                           (char const *)&reference_count,
+                           sizeof (Snapper::RC))
+        || !writer.wait ())
       {
         Genode::error ("could not update reference count: ", value);
+        return Genode::Attempt<Snapper::RC,
+                               Snapper::Archive::Backlink::Error> (WriteErr);
       }
 
-    return res;
+    return Genode::Attempt<Snapper::RC, Snapper::Archive::Backlink::Error> (
+        reference_count);
   }
 
   bool
-  Snapper::Archive::Backlink::is_backlink_valid (Snapper::HASH hash)
+  Snapper::Archive::Backlink::is_backlink_valid (Snapper::HASH hash,
+                                                 Snapper::VERSION expected)
   {
     bool is_backlink_valid = true;
 
     get_version ().with_result (
         [&] (Snapper::VERSION version) {
-          if (version != Version)
+          if (format_version (version) != Version
+              || hash_id (version) != hash_id (expected))
             {
               if (verbose)
                 Genode::log ("backlink has a version mismatch: ", value,
@@ -0,0 +1,59 @@
+#include "buffer_pool.h"
+
+Snapper::Buffer_pool::Buffer_pool (Genode::Allocator &alloc,
+                                   Genode::size_t size)
+    : _alloc (alloc), _size (size)
+{
+  if (!_size)
+    return;
+
+  for (char *&buffer : _buffers)
+    buffer = (char *)_alloc.alloc (_size);
+}
+
+Snapper::Buffer_pool::~Buffer_pool ()
+{
+  for (char *buffer : _buffers)
+    if (buffer)
+      _alloc.free (buffer, _size);
+}
+
+char *
+Snapper::Buffer_pool::_borrow (Genode::size_t size, bool &pooled)
+{
+  pooled = false;
+
+  if (!size)
+    return nullptr;
+
+  if (size <= _size)
+    for (unsigned i = 0; i < BUFFERS; i++)
+      {
+        if (_borrowed[i] || !_buffers[i])
+          continue;
+
+        _borrowed[i] = true;
+        pooled = true;
+        return _buffers[i];
+      }
+
+  return (char *)_alloc.alloc (size);
+}
+
+void
+Snapper::Buffer_pool::_release (char *start, Genode::size_t size,
+                                bool pooled)
+{
+  if (!start)
+    return;
+
+  if (!pooled)
+    {
+      _alloc.free (start, size);
+      return;
+    }
+
+  for (unsigned i = 0; i < BUFFERS; i++)
+    if (_buffers[i] == start)
+      _borrowed[i] = false;
+}
@@ -0,0 +1,141 @@
+#include <util/misc_math.h>
+#include <util/string.h>
+
+#include "hash_engine.h"
+
+namespace
+{
+  struct Crc32c_table
+  {
+    Genode::uint32_t value[256];
+
+    constexpr Crc32c_table () : value ()
+    {
+      for (Genode::uint32_t i = 0; i < 256; i++)
+        {
+          Genode::uint32_t crc = i;
+
+          for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+
+          value[i] = crc;
+        }
+    }
+  };
+
+  constexpr Crc32c_table crc32c_table{};
+
+  Genode::uint32_t
+  crc32c_sw (Genode::uint32_t crc, const void *input, Genode::uint64_t length)
+  {
+    const Genode::uint8_t *data = (const Genode::uint8_t *)input;
+
+    while (length--)
+      crc = crc32c_table.value[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+  }
+
+#if defined(__x86_64__)
+  bool
+  cpu_has_sse42 (void)
+  {
+    Genode::uint32_t eax = 1, ebx, ecx = 0, edx;
+
+    asm volatile ("cpuid"
+                  : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    return ecx & (1U << 20);
+  }
+
+  __attribute__ ((target ("sse4.2"))) Genode::uint32_t
+  crc32c_hw (Genode::uint32_t crc, const void *input, Genode::uint64_t length)
+  {
+    const Genode::uint8_t *data = (const Genode::uint8_t *)input;
+    Genode::uint64_t crc64 = crc;
+
+    for (; length >= 8; data += 8, length -= 8)
+      {
+        Genode::uint64_t word;
+        __builtin_memcpy (&word, data, sizeof (word));
+        crc64 = __builtin_ia32_crc32di (crc64, word);
+      }
+
+    crc = (Genode::uint32_t)crc64;
+
+    while (length--)
+      crc = __builtin_ia32_crc32qi (crc, *data++);
+
+    return crc;
+  }
+#endif
+
+  typedef Genode::uint32_t (*Crc32c_fn) (Genode::uint32_t, const void *,
+                                         Genode::uint64_t);
+
+  Crc32c_fn
+  select_crc32c (void)
+  {
+#if defined(__x86_64__)
+    if (cpu_has_sse42 ())
+      return crc32c_hw;
+#endif
+
+    return crc32c_sw;
+  }
+}
+
+Genode::uint32_t
+Snapper::crc32c_update (Genode::uint32_t crc, const void *input,
+                        Genode::uint64_t length)
+{
+  // INFO The implementation is picked once, on the first use.
+  static const Crc32c_fn fn = select_crc32c ();
+
+  return fn (crc, input, length);
+}
+
+Genode::uint32_t
+Snapper::crc32c (const void *input, Genode::uint64_t length)
+{
+  return ~crc32c_update (~0U, input, length);
+}
+
+Genode::uint32_t
+Snapper::hash_data (Hash_id id, const void *input, Genode::uint64_t length)
+{
+  switch (id)
+    {
+    case Tree_xxh32:
+      return tree_hash (input, length);
+    case Crc32c:
+      return crc32c (input, length);
+    default:
+      return xxhash32 (input, length);
+    }
+}
+
+Genode::uint32_t
+Snapper::copy_and_hash (Hash_id id, void *dst, const void *src,
+                        Genode::uint64_t length)
+{
+  Hasher hasher (id);
+
+  char *to = (char *)dst;
+  char const *from = (char const *)src;
+
+  while (length)
+    {
+      Genode::size_t block
+          = (Genode::size_t)Genode::min (length, (Genode::uint64_t)FUSED_BLOCK);
+
+      Genode::memcpy (to, from, block);
+      hasher.add (to, block);
+
+      to += block;
+      from += block;
+      length -= block;
+    }
+
+  return hasher.hash ();
+}
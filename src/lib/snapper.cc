@@ -20,7 +20,8 @@ namespace Snapper
         timer (env), config (),
         generation (static_cast<Vfs::Simple_env &> (snapper_root)),
         snapshot (static_cast<Vfs::Simple_env &> (snapper_root)),
-        snapshot_dir_path ("/"), archiver (heap, snapper_root, config.verbose)
+        snapshot_dir_path ("/"), archiver (heap, snapper_root, config.verbose),
+        flush_handler (env.ep (), *this, &Main::__handle_flush)
   {
     config.verbose
         = rom.xml ().attribute_value<decltype (Snapper::Config::verbose)> (
@@ -52,18 +53,77 @@ namespace Snapper
         = rom.xml ().attribute_value<decltype (Snapper::Config::expiration)> (
             "expiration", Snapper::Config::_expiration);
 
+    config.checkpoint
+        = rom.xml ().attribute_value<decltype (Snapper::Config::checkpoint)> (
+            "checkpoint", Snapper::Config::_checkpoint);
+
+    config.index_stride
+        = rom.xml ()
+              .attribute_value<decltype (Snapper::Config::index_stride)> (
+                  "index_stride", Snapper::Config::_index_stride);
+
+    config.archive_budget = rom.xml ().attribute_value (
+        "archive_budget",
+        Genode::Number_of_bytes (Snapper::Config::_archive_budget));
+
     config.bufsize
         = rom.xml ().attribute_value (
           "bufsize", Genode::Number_of_bytes(Snapper::Config::_bufsize));
 
+    buffers.construct (heap, config.bufsize);
+
+    config.queue_bufsize = rom.xml ().attribute_value (
+        "queue_bufsize",
+        Genode::Number_of_bytes (Snapper::Config::_queue_bufsize));
+
+    config.workers
+        = rom.xml ().attribute_value<decltype (Snapper::Config::workers)> (
+            "workers", Snapper::Config::_workers);
+
+    pool.construct (env, heap, config.workers);
+
+    config.write_behind = rom.xml ().attribute_value (
+        "write_behind",
+        Genode::Number_of_bytes (Snapper::Config::_write_behind));
+
+    if (config.write_behind)
+      staging = (char *)heap.alloc (config.write_behind);
+
+    config.read_ahead = rom.xml ().attribute_value (
+        "read_ahead", Genode::Number_of_bytes (Snapper::Config::_read_ahead));
+
+    config.tree_threshold = rom.xml ().attribute_value (
+        "tree_threshold",
+        Genode::Number_of_bytes (Snapper::Config::_tree_threshold));
+
+    typedef Genode::String<16> Hash_name;
+    Hash_name hash_name
+        = rom.xml ().attribute_value ("hash", Hash_name ("xxh32"));
+
+    if (hash_name == "crc32c")
+      config.hash = Crc32c;
+    else if (hash_name != "xxh32")
+      Genode::warning ("unknown hash \"", hash_name, "\", using xxh32");
+
     archiver->verbose = config.verbose;
+    archiver->budget = config.archive_budget;
 
-    static Snapper::Root_component root (env, env.ep (), heap, *this, config.bufsize);
+    static Snapper::Root_component root (env, env.ep (), heap, *this,
+                                         config.bufsize,
+                                         config.queue_bufsize);
     env.parent ().announce (env.ep ().manage (root));
   }
 
   Main::~Main ()
   {
+    if (staging)
+      heap.free (staging, config.write_behind);
+
+    __clear_read_ahead (true);
+
+    if (index)
+      Genode::destroy (heap, index);
+
     generation.destruct ();
     snapshot.destruct ();
     archiver.destruct ();
@@ -88,6 +148,8 @@ namespace Snapper
     if (res != Ok)
       return res;
 
+    __load_basis ();
+
     res = __init_gen ();
     if (res != Ok)
       return res;
@@ -104,150 +166,241 @@ namespace Snapper
 
     snapshots_requested++;
 
-    bool new_backlink_needed = false;
-    Snapper::HASH hash = xxhash32 (payload, size);
+    if (__stage (payload, size, identifier))
+      return Ok;
 
-    // check if identifier exists in the mapping and if the hash
-    // matches the calculated hash of the payload.
-    archiver->archive.with_element (
+    __flush_staged ();
+
+    Snapper::VERSION version;
+    Snapper::HASH hash = __hash (payload, size, version, true);
+
+    if (!__reuse_backlink (identifier, hash, size, version))
+      __write_backlink (payload, size, hash, identifier, version);
+
+    return Ok;
+  }
+
+  Snapper::Result
+  Main::take_snapshots (Snapshot_request *requests, Genode::size_t count)
+  {
+    if (state != Creation)
+      {
+        for (Genode::size_t i = 0; i < count; i++)
+          requests[i].result = InvalidState;
+
+        return InvalidState;
+      }
+
+    __flush_staged ();
+
+    // INFO Only the hashing is spread across the workers. The VFS is
+    // not thread-safe and its blocking calls dispatch the I/O signals
+    // of the entrypoint, hence the snapshot files are written by the
+    // entrypoint in order.
+    pool->for_each_item (count, [&] (Genode::size_t i) {
+      requests[i].hash = __hash (requests[i].payload, requests[i].size,
+                                 requests[i].version, false);
+    });
+
+    for (Genode::size_t i = 0; i < count; i++)
+      {
+        Snapshot_request &request = requests[i];
+        snapshots_requested++;
+
+        if (!__reuse_backlink (request.identifier, request.hash, request.size,
+                               request.version))
+          __write_backlink (request.payload, request.size, request.hash,
+                            request.identifier, request.version);
+
+        request.result = Ok;
+      }
+
+    return Ok;
+  }
+
+  Snapper::Result
+  Main::probe_snapshot (Genode::uint64_t size, Snapper::HASH hash,
+                        Archive::ArchiveKey identifier)
+  {
+    if (state != Creation)
+      return InvalidState;
+
+    __flush_staged ();
+
+    // INFO The client hashes with xxhash32, which never matches the
+    // snapshot files of payloads hashed otherwise.
+    if (__hash_id (size) != Xxh32)
+      return PayloadNeeded;
+
+    if (!__reuse_backlink (identifier, hash, size))
+      return PayloadNeeded;
+
+    snapshots_requested++;
+    return Ok;
+  }
+
+  Snapper::Result
+  Main::discard (Archive::ArchiveKey identifier)
+  {
+    if (state != Creation)
+      return InvalidState;
+
+    __flush_staged ();
+
+    Snapper::Result res = NoMatches;
+
+    // INFO Only the changes of the current snapshot are reverted: the
+    // snapshot files it wrote are removed, the references it added to
+    // snapshot files of older generations are released. An empty entry
+    // is dropped once committed.
+    archiver->with_entry (
         identifier,
-        [this, &new_backlink_needed, &hash] (Archive::ArchiveEntry &entry) {
-          // INFO Go through backlinks until a valid one is found.
-          Archive::Backlink *latest_valid_backlink = nullptr;
+        [&] (Archive::ArchiveEntry &entry) {
+          Archive::Backlink *linked = nullptr;
           entry.queue.for_each ([&] (Archive::Backlink &backlink) {
-            if (backlink.is_backlink_valid (hash))
-              {
-                latest_valid_backlink = backlink._self;
-              }
-            else
-              {
-              if (config.verbose)
-                Genode::log ("removing outdated backlink: ", backlink.value);
-
-              entry.queue.remove(backlink);
-              Genode::destroy(archiver->heap, backlink._self);
-              archiver->total_backlinks--;
-              }
+            if (!__written_now (backlink))
+              linked = &backlink;
           });
 
-          if (!latest_valid_backlink)
-            {
-              new_backlink_needed = true;
-              return;
-            }
+          Genode::uint32_t links = archiver->links (entry);
+
+          if (linked && links)
+            linked->get_reference_count ().with_result (
+                [&] (Snapper::RC rc) {
+                  if (linked
+                          ->write_reference_count (rc > links ? rc - links
+                                                              : 0,
+                                                   rc_writer)
+                          .failed ())
+                    Genode::error ("could not release snapshot file: ",
+                                   linked->value);
+                },
+                [&] (Archive::Backlink::Error) {
+                  Genode::error ("could not release snapshot file: ",
+                                 linked->value);
+                });
 
-          latest_valid_backlink->get_reference_count ().with_result (
-              [this, &new_backlink_needed,
-               &latest_valid_backlink] (Snapper::RC rc) {
-                if (rc >= config.redundancy)
-                  {
-                    if (config.verbose)
-                      Genode::log ("backlink reference count exceeded: ",
-                                   latest_valid_backlink->value,
-                                   ". Creating redundant copy.");
+          archiver->total_backlinks
+              -= entry.queue.remove_if ([&] (Archive::Backlink &backlink) {
+                   if (__written_now (backlink))
+                     snapper_root.unlink (backlink.value);
 
-                    new_backlink_needed = true;
-                  }
-                else
-                  {
-                    if (latest_valid_backlink->set_reference_count (rc + 1)
-                            .failed ())
-                      {
-                        Genode::error ("failed to update reference count of "
-                                       "backlink! Creating a new backlink.");
+                   return true;
+                 });
 
-                        new_backlink_needed = true;
-                      }
-                  }
-              },
-              [&new_backlink_needed] (Snapper::Archive::Backlink::Error) {
-                // INFO Technically, this code should not be reachable
-                // since we already checked that the backlink is valid.
-                new_backlink_needed = true;
-              });
+          archiver->touch (entry);
+          archiver->mark_submitted (entry);
+          res = Ok;
         },
-        [&] () { new_backlink_needed = true; });
-
-    if (!new_backlink_needed)
-      return Ok;
+        [] () {});
 
-    snapshot_files_created++;
+    return res;
+  }
 
-    // create a new snapshot file and write to it the payload metadata
-    // and the payload data
+  Snapper::Result
+  Main::begin_snapshot (Archive::ArchiveKey identifier)
+  {
+    if (state != Creation || upload.constructed ())
+      return InvalidState;
 
-    snapshot_file_count++;
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        filepath_base = __next_backlink_name ();
 
-    if (snapshot_file_count >= config.threshold)
+    try
       {
-        snapshot->create_sub_directory ("ext");
-        if (!snapshot->directory_exists ("ext"))
-          {
-            Genode::error ("could not create extender sub-directory!");
-            throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
-          }
-
-        /* INFO
-           `snapshot.construct()` will run the destructor first, hence
-           we need to copy the old snapshot directory.
-         */
-        Genode::Directory old_snapshot_dir(*snapshot, "/");
-        
-        snapshot.construct (old_snapshot_dir, "ext");
-        snapshot_dir_path = Genode::Directory::join (snapshot_dir_path, "ext");
-        snapshot_file_count = 0;
+        upload.construct (*snapshot, filepath_base,
+                          Genode::Directory::join (snapshot_dir_path,
+                                                   filepath_base),
+                          identifier, config.hash);
+      }
+    catch (Genode::New_file::Create_failed)
+      {
+        Genode::error ("could not create file: ", filepath_base);
+        return InvalidState;
       }
 
-    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
-        filepath_base ((Genode::Hex (snapshot_file_count)));
+    // INFO The hash is only known once the payload is complete, it is
+    // patched by finish_snapshot().
+    Snapshot_header header (version_byte (config.hash));
 
-    try
+    if (upload->file.append (header.bytes, sizeof (header.bytes))
+        != Genode::New_file::Append_result::OK)
       {
-        VERSION ver = Version;
+        Genode::error ("could not write to file: ", upload->path);
+        __drop_upload ();
+        throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      }
 
-        Genode::New_file file (*snapshot, filepath_base);
+    return Ok;
+  }
+
+  Snapper::Result
+  Main::append_snapshot (void const *const payload, Genode::uint64_t size)
+  {
+    if (state != Creation || !upload.constructed ())
+      return InvalidState;
+
+    if (!size)
+      return Ok;
+
+    upload->hash.add (payload, size);
+    upload->size += size;
 
-        Genode::size_t buf_size = sizeof (Snapper::VERSION)
-                                  + sizeof (Snapper::HASH)
-                                  + sizeof (Snapper::RC) + size;
+    if (upload->file.append ((char const *)payload, size)
+        != Genode::New_file::Append_result::OK)
+      {
+        Genode::error ("could not write to file: ", upload->path);
+        __drop_upload ();
+        throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      }
 
-        char *buf = new (heap) char[buf_size];
+    return Ok;
+  }
 
-        Genode::memcpy (buf, (char *)&ver, sizeof (Snapper::VERSION));
-        Genode::memcpy (buf + sizeof (Snapper::VERSION), (char *)&hash,
-                        sizeof (Snapper::HASH));
+  Snapper::Result
+  Main::finish_snapshot (void)
+  {
+    if (state != Creation || !upload.constructed ())
+      return InvalidState;
 
-        Snapper::RC reference_count = 1;
-        Genode::memcpy (buf + sizeof (Snapper::VERSION)
-                            + sizeof (Snapper::HASH),
-                        (char *)&reference_count, sizeof (Snapper::RC));
+    snapshots_requested++;
+    __flush_staged ();
 
-        Genode::memcpy (buf + sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
-                            + sizeof (Snapper::RC),
-                        payload, size);
+    Archive::ArchiveKey identifier = upload->identifier;
+    Genode::uint64_t size = upload->size;
+    Snapper::HASH hash = upload->hash.hash ();
 
-        Genode::New_file::Append_result res = file.append (buf, buf_size);
+    // INFO The size is not known in advance, hence streamed payloads
+    // never use the tree hash.
+    Snapper::VERSION version = version_byte (config.hash);
 
-        heap.free (buf, buf_size);
+    Genode::String<Vfs::MAX_PATH_LEN> path = upload->path;
 
-        if (res != Genode::New_file::Append_result::OK)
-          {
-            Genode::error ("could not write to backlink file: ",
-                           filepath_base);
-            throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
-          }
+    // INFO Closes the snapshot file before its header is patched.
+    upload.destruct ();
+
+    if (__reuse_backlink (identifier, hash, size, version))
+      {
+        snapper_root.unlink (path);
+        snapshot_files_created--;
+        return Ok;
       }
-    catch (Genode::New_file::Create_failed)
+
+    // INFO Only the version and the hash are overwritten, the
+    // reference count of the placeholder is already valid.
+    Snapshot_header header (version, hash);
+
+    if (!rc_writer.submit_at (Vfs_writer::Path ("/", path), 0, header.bytes,
+                              sizeof (Snapper::VERSION)
+                                  + sizeof (Snapper::HASH))
+        || !rc_writer.wait ())
       {
-        Genode::error ("could not create file: ", filepath_base);
+        Genode::error ("could not write to backlink file: ", path);
+        snapper_root.unlink (path);
         throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
       }
 
-    // save the snapshot file's path (i.e. a backlink) into the archive
-    // (relative to snapper_root)
-
-    archiver->insert (identifier, Genode::Directory::join (snapshot_dir_path,
-                                                           filepath_base));
+    archiver->insert (identifier, path);
     return Ok;
   }
 
@@ -257,12 +410,30 @@ namespace Snapper
     if (state != Creation)
       return InvalidState;
 
+    // INFO The key of an unfinished upload would silently be carried
+    // forward, hence it must be finished first.
+    if (upload.constructed ())
+      {
+        Genode::error ("snapshot of key ", upload->identifier,
+                       " is not finished!");
+        return InvalidState;
+      }
+
     if (!generation.constructed ())
       {
         Genode::error ("generation object was not constructed!");
         return InvalidState;
       }
 
+    if (flush_failed)
+      {
+        Genode::error ("staged payloads were lost! Aborting the snapshot.");
+
+        __abort_snapshot ();
+        state = Dormant;
+        return WriteFailed;
+      }
+
     if (!archiver.constructed ())
       {
         if (config.verbose)
@@ -274,7 +445,31 @@ namespace Snapper
         return InvalidState;
       }
 
-    archiver->commit (*generation);
+    // INFO Durability barrier, every acknowledged payload is written
+    // before the archive references it.
+    __flush_staged ();
+
+    // INFO Only write the changes since the archiver's generation,
+    // unless the delta chain became too long or the archiver does not
+    // match any (still existing) generation.
+    bool delta = config.checkpoint && archiver_gen != ""
+                 && delta_chain < config.checkpoint
+                 && __valid_gen (archiver_gen);
+
+    __carry_forward ();
+
+    if (delta)
+      archiver->commit_delta (*generation, archiver_gen);
+    else
+      archiver->commit (*generation);
+
+    archiver->seal ();
+    archiver_gen = generation_name;
+    delta_chain = delta ? delta_chain + 1 : 0;
+
+    // INFO The committed generation supersedes the opened one as the
+    // basis of the next snapshot.
+    basis_gen = generation_name;
 
     Genode::Microseconds snap_fin {timer.curr_time().trunc_to_plain_us()};
 
@@ -322,44 +517,345 @@ namespace Snapper
   Snapper::Result
   Main::restore (void *dst, Genode::size_t size,
                  Archive::ArchiveKey identifier)
+  {
+    Genode::memset (dst, 0, size);
+
+    Genode::size_t restored = 0;
+    Snapper::Result res = restore (dst, size, identifier, restored);
+
+    return res == NoData ? RestoreFailed : res;
+  }
+
+  Snapper::Result
+  Main::restore (void *dst, Genode::size_t capacity,
+                 Archive::ArchiveKey identifier, Genode::size_t &size)
   {
     if (state != Restoration)
       return InvalidState;
 
+    if (!index)
+      return InvalidState;
+
     Snapper::Result res = Ok;
-    Genode::memset (dst, 0, size);
+    bool restored = false;
+    size = 0;
 
-    archiver->archive.with_element (
+    prefetched.with_element (
         identifier,
-        [&res, &dst, &size] (Archive::ArchiveEntry &entry) {
-          entry.queue.for_each (
-              [&res, &dst, &size] (Archive::Backlink &backlink) {
-                Genode::Byte_range_ptr dst_buf ((char *)dst, size);
-                switch (backlink.get_data (dst_buf))
-                  {
-                  case Archive::Backlink::Error::None:
-                    res = Ok;
-                    break;
-                  case Archive::Backlink::Error::InvalidVersion:
-                    res = InvalidVersion;
-                    break;
-                  case Archive::Backlink::Error::InvalidIntegrity:
-                    res = IntegrityFailed;
-                    break;
-                  case Archive::Backlink::Error::MissingFieldErr:
-                    res = IntegrityFailed;
-                    break;
-                  default:
-                    res = RestoreFailed;
-                    break;
-                  }
-              });
+        [&] (Prefetched &payload) {
+          restored = true;
+          size = payload.size;
+
+          if (payload.size > capacity)
+            res = NoData;
+          else
+            Genode::memcpy (dst, read_ahead + payload.offset, payload.size);
         },
-        [&res] () { res = NoMatches; });
+        [] () {});
+
+    if (restored)
+      return res;
+
+    bool found = index->with_backlinks (
+        identifier,
+        [&] (const decltype (Archive::Backlink::value) & value) {
+          // INFO The backlinks are redundant copies, the first one that
+          // can be restored is used.
+          if (restored)
+            return;
+
+          Archive::Backlink backlink (heap, snapper_root, config.verbose,
+                                      value);
+
+          Genode::size_t data_size = 0;
+          backlink.get_data_size ().with_result (
+              [&] (Genode::size_t _size) { data_size = _size; },
+              [&] (Archive::Backlink::Error) { res = RestoreFailed; });
+
+          if (!data_size)
+            return;
+
+          size = data_size;
+          if (data_size > capacity)
+            {
+              res = NoData;
+              return;
+            }
+
+          Genode::Byte_range_ptr dst_buf ((char *)dst, data_size);
+          switch (backlink.get_data (dst_buf))
+            {
+            case Archive::Backlink::Error::None:
+              res = Ok;
+              break;
+            case Archive::Backlink::Error::InvalidVersion:
+              res = InvalidVersion;
+              break;
+            case Archive::Backlink::Error::InvalidIntegrity:
+              res = IntegrityFailed;
+              break;
+            case Archive::Backlink::Error::MissingFieldErr:
+              res = IntegrityFailed;
+              break;
+            default:
+              res = RestoreFailed;
+              break;
+            }
+
+          restored = res == Ok;
+        });
+
+    if (!found)
+      res = NoMatches;
 
     return res;
   }
 
+  Snapper::Result
+  Main::restore_range (void *dst, Genode::size_t offset, Genode::size_t length,
+                       Archive::ArchiveKey identifier)
+  {
+    if (state != Restoration)
+      return InvalidState;
+
+    if (!index)
+      return InvalidState;
+
+    Genode::String<Vfs::MAX_PATH_LEN> value;
+
+    verified.with_element (
+        identifier, [&] (Verified &entry) { value = entry.value; }, [] () {});
+
+    Snapper::Result res = Ok;
+
+    // INFO The first range of a key verifies the whole data, the
+    // snapshot files of an opened generation do not change afterwards.
+    if (value == "")
+      {
+        bool found = index->with_backlinks (
+            identifier,
+            [&] (const decltype (Archive::Backlink::value) & backlink_value) {
+              if (value != "")
+                return;
+
+              Archive::Backlink backlink (heap, snapper_root, config.verbose,
+                                          backlink_value);
+
+              switch (backlink.verify_data (*buffers))
+                {
+                case Archive::Backlink::Error::None:
+                  value = backlink_value;
+                  break;
+                case Archive::Backlink::Error::InvalidVersion:
+                  res = InvalidVersion;
+                  break;
+                case Archive::Backlink::Error::InvalidIntegrity:
+                  res = IntegrityFailed;
+                  break;
+                case Archive::Backlink::Error::MissingFieldErr:
+                  res = IntegrityFailed;
+                  break;
+                default:
+                  res = RestoreFailed;
+                  break;
+                }
+            });
+
+        if (!found)
+          return NoMatches;
+
+        if (value == "")
+          return res;
+
+        verified.insert (identifier, value);
+      }
+
+    Archive::Backlink backlink (heap, snapper_root, config.verbose, value);
+    Genode::Byte_range_ptr dst_buf ((char *)dst, length);
+
+    switch (backlink.get_data_range (dst_buf, offset))
+      {
+      case Archive::Backlink::Error::None:
+        return Ok;
+      case Archive::Backlink::Error::InsufficientSizeErr:
+        return NoData;
+      default:
+        return RestoreFailed;
+      }
+  }
+
+  Snapper::Result
+  Main::prefetch (Archive::ArchiveKey first, Genode::uint64_t count)
+  {
+    if (state != Restoration)
+      return InvalidState;
+
+    if (!index)
+      return InvalidState;
+
+    if (!config.read_ahead)
+      return NoData;
+
+    __clear_read_ahead (false);
+
+    if (!read_ahead)
+      read_ahead = (char *)heap.alloc (config.read_ahead);
+
+    struct Candidate
+    {
+      Archive::ArchiveKey key;
+      decltype (Archive::Backlink::value) value;
+      Snapper::HASH hash;
+      Snapper::VERSION version;
+      Genode::size_t offset;
+      Genode::size_t size;
+      bool valid;
+    };
+
+    count = Genode::min (count, (Genode::uint64_t)PREFETCH_KEYS);
+    if (!count)
+      return Ok;
+
+    Candidate *candidates = new (heap) Candidate[count];
+    Genode::size_t num_candidates = 0;
+
+    // INFO Only the first backlink of each key is prefetched, which
+    // is the one restore() tries first.
+    for (Genode::uint64_t i = 0; i < count; i++)
+      {
+        bool taken = false;
+
+        index->with_backlinks (
+            first + i,
+            [&] (const decltype (Archive::Backlink::value) & value) {
+              if (taken)
+                return;
+
+              candidates[num_candidates].key = first + i;
+              candidates[num_candidates].value = value;
+              candidates[num_candidates].valid = false;
+              num_candidates++;
+              taken = true;
+            });
+      }
+
+    using Dir_name = Genode::String<Vfs::MAX_PATH_LEN>;
+
+    // INFO Snapshot files are named by their hexadecimal index, which
+    // does not sort as a string (0x10 before 0x2). Orders by
+    // directory first, then by the numeric index.
+    auto before = [] (char const *a, char const *b) {
+      char const *a_name = a, *b_name = b;
+
+      for (char const *c = a; *c; c++)
+        if (*c == '/')
+          a_name = c + 1;
+
+      for (char const *c = b; *c; c++)
+        if (*c == '/')
+          b_name = c + 1;
+
+      int dir = Genode::strcmp (
+          Dir_name (Genode::Cstring (a, a_name - a)).string (),
+          Dir_name (Genode::Cstring (b, b_name - b)).string ());
+      if (dir)
+        return dir < 0;
+
+      Genode::uint64_t a_index = 0, b_index = 0;
+      Genode::ascii_to_unsigned (a_name, a_index, 0);
+      Genode::ascii_to_unsigned (b_name, b_index, 0);
+      return a_index < b_index;
+    };
+
+    // INFO Sorts the candidates by path, the number of candidates is
+    // bounded by PREFETCH_KEYS.
+    for (Genode::size_t i = 1; i < num_candidates; i++)
+      for (Genode::size_t j = i;
+           j
+           && before (candidates[j].value.string (),
+                      candidates[j - 1].value.string ());
+           j--)
+        {
+          Candidate tmp = candidates[j];
+          candidates[j] = candidates[j - 1];
+          candidates[j - 1] = tmp;
+        }
+
+    for (Genode::size_t i = 0; i < num_candidates; i++)
+      {
+        Candidate &candidate = candidates[i];
+        Archive::Backlink backlink (heap, snapper_root, config.verbose,
+                                    candidate.value);
+
+        bool readable = false;
+
+        backlink.get_version ().with_result (
+            [&] (Snapper::VERSION ver) {
+              candidate.version = ver;
+              readable = format_version (ver) == Snapper::Version;
+            },
+            [] (Archive::Backlink::Error) {});
+
+        backlink.get_integrity ().with_result (
+            [&] (Snapper::HASH hash) { candidate.hash = hash; },
+            [&] (Archive::Backlink::Error) { readable = false; });
+
+        backlink.get_data_size ().with_result (
+            [&] (Genode::size_t size) { candidate.size = size; },
+            [&] (Archive::Backlink::Error) { readable = false; });
+
+        // INFO Payloads which cannot be prefetched are left to
+        // restore().
+        if (!readable || candidate.size > config.read_ahead - read_ahead_used)
+          continue;
+
+        Genode::Byte_range_ptr buf (read_ahead + read_ahead_used,
+                                    candidate.size);
+
+        if (backlink.get_data_range (buf, 0) != Archive::Backlink::Error::None)
+          continue;
+
+        candidate.offset = read_ahead_used;
+        candidate.valid = true;
+        read_ahead_used += candidate.size;
+      }
+
+    pool->for_each_item (num_candidates, [&] (Genode::size_t i) {
+      Candidate &candidate = candidates[i];
+
+      if (candidate.valid)
+        candidate.valid = payload_hash (candidate.version,
+                                        read_ahead + candidate.offset,
+                                        candidate.size)
+                          == candidate.hash;
+    });
+
+    for (Genode::size_t i = 0; i < num_candidates; i++)
+      if (candidates[i].valid)
+        prefetched.insert (candidates[i].key, candidates[i].offset,
+                           candidates[i].size);
+
+    if (config.verbose)
+      Genode::log ("prefetched ", prefetched.count (), " of ", count,
+                   " keys");
+
+    heap.free (candidates, sizeof (Candidate) * count);
+    return Ok;
+  }
+
+  void
+  Main::__clear_read_ahead (bool release)
+  {
+    prefetched.clear ();
+    read_ahead_used = 0;
+
+    if (release && read_ahead)
+      {
+        heap.free (read_ahead, config.read_ahead);
+        read_ahead = nullptr;
+      }
+  }
+
   Snapper::Result
   Main::close_generation (void)
   {
@@ -367,12 +863,20 @@ namespace Snapper
       return InvalidState;
 
     state = Dormant;
+    verified.clear ();
+    __clear_read_ahead (true);
 
     if (generation.constructed ())
       generation.destruct ();
 
-    // INFO Do not destruct the archiver as it will be used as the
-    // basis for future snapshots.
+    if (index)
+      {
+        Genode::destroy (heap, index);
+        index = nullptr;
+      }
+
+    // INFO The opened generation remains the basis for future
+    // snapshots (see __load_basis()).
 
     purge_expired ();
 
@@ -408,8 +912,7 @@ namespace Snapper
       {
         snapper_root.for_each_entry ([this, &validity_verified, &_gen] (
                                          Genode::Directory::Entry &entry) {
-          if (__valid_archive (
-                  Genode::Directory::join (entry.name (), "archive")))
+          if (__valid_gen (entry.name ()))
             {
               if (_gen == "")
                 {
@@ -435,7 +938,7 @@ namespace Snapper
 
     if (!validity_verified)
       {
-        if (!__valid_archive (Genode::Directory::join (_gen, "archive")))
+        if (!__valid_gen (_gen))
           {
             if (config.verbose)
               Genode::log ("no generation exists for purging");
@@ -449,60 +952,56 @@ namespace Snapper
 
     try
       {
-        Genode::Directory archive_dir (snapper_root, _gen);
-        Genode::Readonly_file archive_file (archive_dir, "archive");
-
-        Archive archiver_to_purge (heap, snapper_root, config.verbose);
-        archiver_to_purge.extract_from_archive_file (archive_file);
-
-        while (true)
-          {
-            bool has_element = archiver_to_purge.archive.with_any_element (
-                [this,
-                 &archiver_to_purge] (const Archive::ArchiveEntry &entry) {
-                  // decrement each backlink's reference count
-                  entry.queue.for_each ([this] (Archive::Backlink &backlink) {
-                    bool remove = false;
-
-                    backlink.get_reference_count ().with_result (
-                        [&backlink, &remove] (Snapper::RC reference_count) {
-                          reference_count--;
-
-                          // if the reference count is 0 or less, remove the
-                          // backlink
-                          if (reference_count > 0)
+        Archive archiver_to_purge (heap, snapper_root, config.verbose,
+                                   config.archive_budget);
+        __extract_gen (_gen, archiver_to_purge);
+
+        // INFO Delta generations based on this one must not lose their
+        // parent.
+        __rebase_children (_gen);
+
+        // INFO Walk the entries in key order, so spilled partitions of
+        // the archive are paged in one after another.
+        archiver_to_purge.for_each_entry (
+            [this] (const Archive::ArchiveEntry &entry) {
+              // decrement each backlink's reference count
+              entry.queue.for_each ([this] (Archive::Backlink &backlink) {
+                bool remove = false;
+
+                backlink.get_reference_count ().with_result (
+                    [this, &backlink, &remove] (Snapper::RC reference_count) {
+                      reference_count--;
+
+                      // if the reference count is 0 or less, remove the
+                      // backlink
+                      if (reference_count > 0)
+                        {
+                          if (backlink
+                                  .write_reference_count (reference_count,
+                                                          rc_writer)
+                                  .failed ())
                             {
-                              if (backlink
-                                      .set_reference_count (reference_count)
-                                      .failed ())
-                                {
-                                  remove = true;
-                                }
+                              remove = true;
                             }
-                          else
-                            remove = true;
-                        },
-                        [&remove, this] (Archive::Backlink::Error) {
-                          if (config.integrity)
-                            remove = true;
-                        });
-
-                    if (remove)
-                      __delete_upwards (backlink.value.string ());
-
-                    /* INFO
-                     * No need to dequeue the Backlink as the entire
-                     * ArchiveEntry will be removed.
-                     */
-                  });
-                  archiver_to_purge.remove (entry.name);
-                });
-
-            if (!has_element)
-              {
-                break;
-              }
-          }
+                        }
+                      else
+                        remove = true;
+                    },
+                    [&remove, this] (Archive::Backlink::Error) {
+                      if (config.integrity)
+                        remove = true;
+                    });
+
+                if (remove)
+                  __delete_upwards (backlink.value.string ());
+
+                /* INFO
+                 * No need to dequeue the Backlink as the entire
+                 * archive is destroyed afterwards.
+                 */
+              });
+            });
+        __delete_upwards (Genode::Directory::join (_gen, "delta").string ());
         __delete_upwards (Genode::Directory::join (_gen, "archive").string ());
         __reset_gen ();
       }
@@ -555,6 +1054,9 @@ namespace Snapper
 
     snapper_root.for_each_entry (
         [this, expiry] (Genode::Directory::Entry &entry) {
+          if (__hidden_entry (entry))
+            return;
+
           try
             {
               Rtc::Timestamp ts
@@ -592,7 +1094,7 @@ namespace Snapper
 
     // for each dead snapshot run __purge_zombies helper.
     snapper_root.for_each_entry ([&] (Genode::Directory::Entry &e) {
-      if (!__valid_archive (Genode::Directory::join (e.name (), "archive")))
+      if (!__hidden_entry (e) && !__valid_gen (e.name ()))
         {
           __purge_zombies (e.name ());
         }
@@ -693,19 +1195,46 @@ namespace Snapper
         pos.value = sizeof (Snapper::VERSION) + sizeof (Snapper::HASH)
                     + sizeof (decltype (Archive::total_backlinks));
 
-        char *_data_buf = (char *)heap.alloc (data_size);
-        Genode::Byte_range_ptr data (_data_buf, data_size);
+        // INFO The data is hashed in pieces of a borrowed buffer, so
+        // the archive never has to fit into the heap at once.
+        Genode::size_t chunk_size = (Genode::size_t)Genode::min (
+            data_size, (Vfs::file_size)buffers->buffer_size ());
+
+        XXHash32 hasher (0);
+        bool missing = false;
+
+        buffers->with_buffer (chunk_size, [&] (Genode::Byte_range_ptr &chunk) {
+          for (Vfs::file_size offset = 0; offset < data_size;)
+            {
+              Genode::Byte_range_ptr buf (
+                  chunk.start, (Genode::size_t)Genode::min (
+                                   (Vfs::file_size)chunk_size,
+                                   data_size - offset));
+
+              Genode::size_t bytes_read = _archive.read (
+                  Genode::Readonly_file::At{ pos.value
+                                             + (Genode::size_t)offset },
+                  buf);
+
+              if (!bytes_read)
+                {
+                  missing = true;
+                  return;
+                }
 
-        if (_archive.read (pos, data) == 0)
+              hasher.add (chunk.start, bytes_read);
+              offset += bytes_read;
+            }
+        });
+
+        if (missing)
           {
             Genode::error ("invalid archive, missing data: ", archive_path);
-            heap.free (data.start, data.num_bytes);
             return false;
           }
 
         // calculate and check hash
-        bool integrity = hash != xxhash32 (data.start, data.num_bytes);
-        heap.free (data.start, data.num_bytes);
+        bool integrity = hash != hasher.hash ();
 
         if (integrity)
           {
@@ -732,11 +1261,214 @@ namespace Snapper
       }
     catch (Genode::Denied)
       {
-        Genode::error ("could not allocate heap: allocation denied!");
-        return false;
+        Genode::error ("could not allocate heap: allocation denied!");
+        return false;
+      }
+
+    return true;
+  }
+
+  bool
+  Main::__valid_gen (
+      const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+          &gen)
+  {
+    return __archive_path (gen) != "";
+  }
+
+  Genode::String<Vfs::MAX_PATH_LEN>
+  Main::__archive_path (
+      const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+          &gen)
+  {
+    Genode::String<Vfs::MAX_PATH_LEN> archive
+        = Genode::Directory::join (gen, "archive");
+
+    if (__valid_archive (archive))
+      return archive;
+
+    Genode::String<Vfs::MAX_PATH_LEN> delta
+        = Genode::Directory::join (gen, "delta");
+
+    if (__valid_archive (delta))
+      return delta;
+
+    return "";
+  }
+
+  Genode::uint64_t
+  Main::__extract_gen (
+      const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+          &gen,
+      Archive &target)
+  {
+    Genode::String<Vfs::MAX_PATH_LEN> archive_path = __archive_path (gen);
+
+    if (archive_path == "")
+      {
+        Genode::error ("generation has no valid archive: ", gen);
+        throw CrashStates::INVALID_ARCHIVE_FILE;
+      }
+
+    if (archive_path == Genode::Directory::join (gen, "archive"))
+      {
+        Genode::Readonly_file archive_file (snapper_root, archive_path);
+        target.extract_from_archive_file (archive_file);
+
+        return 0;
+      }
+
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN> parent;
+    {
+      Genode::Readonly_file delta_file (snapper_root, archive_path);
+      parent = Archive::delta_file_parent (delta_file);
+    }
+
+    // INFO Parents are always older than their children, which also
+    // rules out cycles in the delta chain.
+    if (!(gen > parent))
+      {
+        Genode::error ("delta file has an invalid parent: ", gen, " -> ",
+                       parent);
+        throw CrashStates::INVALID_ARCHIVE_FILE;
+      }
+
+    Genode::uint64_t depth = __extract_gen (parent, target) + 1;
+
+    Genode::Readonly_file delta_file (snapper_root, archive_path);
+    target.extract_from_delta_file (delta_file);
+
+    return depth;
+  }
+
+  Archive::Index *
+  Main::__index_gen (
+      const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+          &gen)
+  {
+    Genode::String<Vfs::MAX_PATH_LEN> archive_path = __archive_path (gen);
+
+    if (archive_path == "")
+      {
+        Genode::error ("generation has no valid archive: ", gen);
+        throw CrashStates::INVALID_ARCHIVE_FILE;
+      }
+
+    if (archive_path == Genode::Directory::join (gen, "archive"))
+      return new (heap) Archive::Index (heap, snapper_root, archive_path,
+                                        false, config.index_stride);
+
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN> parent;
+    {
+      Genode::Readonly_file delta_file (snapper_root, archive_path);
+      parent = Archive::delta_file_parent (delta_file);
+    }
+
+    if (!(gen > parent))
+      {
+        Genode::error ("delta file has an invalid parent: ", gen, " -> ",
+                       parent);
+        throw CrashStates::INVALID_ARCHIVE_FILE;
+      }
+
+    // INFO The parent is only attached once it is complete, so the
+    // destructor of the delta's index frees the chain on any error.
+    Archive::Index *index = new (heap) Archive::Index (
+        heap, snapper_root, archive_path, true, config.index_stride);
+
+    try
+      {
+        index->parent = __index_gen (parent);
+      }
+    catch (...)
+      {
+        Genode::destroy (heap, index);
+        throw;
+      }
+
+    return index;
+  }
+
+  void
+  Main::__load_basis (void)
+  {
+    if (basis_gen == "" || basis_gen == archiver_gen)
+      return;
+
+    if (!__valid_gen (basis_gen))
+      {
+        Genode::warning ("opened generation no longer exists: ", basis_gen);
+        basis_gen = "";
+        return;
+      }
+
+    if (config.verbose)
+      Genode::log ("loading generation: ", basis_gen);
+
+    archiver_gen = "";
+    archiver.construct (heap, snapper_root, config.verbose,
+                        config.archive_budget);
+
+    try
+      {
+        delta_chain = __extract_gen (basis_gen, *archiver);
+      }
+    catch (Genode::File::Open_failed)
+      {
+        Genode::error ("failed to open archive file of generation: ",
+                       basis_gen);
+
+        if (config.integrity)
+          throw CrashStates::INVALID_ARCHIVE_FILE;
+
+        // INFO Continue with an empty archiver, i.e. without
+        // deduplication against the opened generation.
+        archiver.construct (heap, snapper_root, config.verbose,
+                        config.archive_budget);
+        basis_gen = "";
+        return;
+      }
+
+    archiver->seal ();
+    archiver_gen = basis_gen;
+  }
+
+  void
+  Main::__rebase_children (
+      const Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+          &gen)
+  {
+    snapper_root.for_each_entry ([&] (Genode::Directory::Entry &entry) {
+      Genode::String<Vfs::MAX_PATH_LEN> delta_path
+          = Genode::Directory::join (entry.name (), "delta");
+
+      if (__archive_path (entry.name ()) != delta_path)
+        return;
+
+      {
+        Genode::Readonly_file delta_file (snapper_root, delta_path);
+        if (Archive::delta_file_parent (delta_file) != gen)
+          return;
       }
 
-    return true;
+      Archive rebased (heap, snapper_root, config.verbose,
+                       config.archive_budget);
+      __extract_gen (entry.name (), rebased);
+
+      Genode::Directory child (snapper_root, entry.name ());
+
+      // INFO An invalid archive file can only be left over from an
+      // interrupted rebase. The delta file is removed only after the
+      // full archive is written, so the child stays valid throughout.
+      if (child.file_exists ("archive"))
+        child.unlink ("archive");
+
+      rebased.commit (child);
+      child.unlink ("delta");
+
+      if (config.verbose)
+        Genode::log ("rebased delta generation: ", entry.name ());
+    });
   }
 
   Snapper::Result
@@ -745,10 +1477,7 @@ namespace Snapper
     Snapper::Result res = Ok;
 
     snapper_root.for_each_entry ([this, &res] (Genode::Directory::Entry &e) {
-      Genode::Path<Vfs::MAX_PATH_LEN> archive
-          = Genode::Directory::join (e.name (), "archive");
-
-      if (!__valid_archive (archive))
+      if (!__hidden_entry (e) && !__valid_gen (e.name ()))
         {
           snapper_root.unlink (e.name ());
           if (snapper_root.directory_exists (e.name ()))
@@ -791,6 +1520,7 @@ namespace Snapper
       }
 
     generation.construct (snapper_root, timestamp);
+    generation_name = timestamp;
 
     generation->create_sub_directory ("snapshot");
     if (!generation->directory_exists ("snapshot"))
@@ -820,6 +1550,7 @@ namespace Snapper
     snapshots_requested = 0;
     snapshot_files_created = 0;
     snap_start.value = 0;
+    generation_name = "";
 
     snapshot.destruct ();
     generation.destruct ();
@@ -839,8 +1570,7 @@ namespace Snapper
       {
         snapper_root.for_each_entry ([this, &validity_verified, &latest] (
                                          Genode::Directory::Entry &entry) {
-          if (__valid_archive (
-                  Genode::Directory::join (entry.name (), "archive")))
+          if (__valid_gen (entry.name ()))
             {
               if (latest == "")
                 {
@@ -860,7 +1590,7 @@ namespace Snapper
 
     if (!validity_verified)
       {
-        if (!__valid_archive (Genode::Directory::join (latest, "archive")))
+        if (!__valid_gen (latest))
           {
             return NoPriorGen;
           }
@@ -870,16 +1600,22 @@ namespace Snapper
       {
         if (config.verbose)
           {
-            Genode::log ("loading generation: ", latest);
+            Genode::log ("indexing generation: ", latest);
           }
 
-        archiver.construct (heap, snapper_root, config.verbose);
+        if (index)
+          {
+            Genode::destroy (heap, index);
+            index = nullptr;
+          }
 
-        // INFO Load the latest valid generation.
-        Genode::Readonly_file archive_file (
-            snapper_root, Genode::Directory::join (latest, "archive"));
+        verified.clear ();
+        __clear_read_ahead (false);
 
-        archiver->extract_from_archive_file (archive_file);
+        // INFO Only index the latest valid generation. Its archive is
+        // loaded into the archiver once a new snapshot is initialized.
+        index = __index_gen (latest);
+        basis_gen = latest;
       }
     catch (Genode::File::Open_failed)
       {
@@ -897,9 +1633,444 @@ namespace Snapper
     return Ok;
   }
 
+  bool
+  Main::__reuse_backlink (Archive::ArchiveKey identifier, Snapper::HASH hash,
+                          Genode::uint64_t size, Snapper::VERSION version)
+  {
+    bool new_backlink_needed = false;
+
+    // check if identifier exists in the mapping and if the hash
+    // matches the calculated hash of the payload.
+    archiver->with_entry (
+        identifier,
+        [this, &new_backlink_needed, &hash, &size,
+         &version] (Archive::ArchiveEntry &entry) {
+          archiver->mark_submitted (entry);
+
+          // INFO Drop the outdated backlinks, the latest of the
+          // remaining ones is used.
+          Genode::uint32_t removed
+              = entry.queue.remove_if ([&] (Archive::Backlink &backlink) {
+                  if (backlink.is_backlink_valid (hash, version))
+                    return false;
+
+                  if (config.verbose)
+                    Genode::log ("removing outdated backlink: ",
+                                 backlink.value);
+
+                  return true;
+                });
+
+          if (removed)
+            {
+              archiver->total_backlinks -= removed;
+              archiver->touch (entry);
+            }
+
+          Archive::Backlink *latest_valid_backlink = nullptr;
+          entry.queue.for_each ([&] (Archive::Backlink &backlink) {
+            latest_valid_backlink = &backlink;
+          });
+
+          if (!latest_valid_backlink)
+            {
+              new_backlink_needed = true;
+              return;
+            }
+
+          // INFO CRC32C only detects corruption, equal CRCs are no
+          // evidence of equal payloads. Such payloads are always
+          // written instead of linked.
+          if (hash_id (version) == Crc32c)
+            {
+              new_backlink_needed = true;
+              return;
+            }
+
+          // INFO Guards against hash collisions between payloads of
+          // different sizes.
+          latest_valid_backlink->get_data_size ().with_result (
+              [&] (Genode::size_t data_size) {
+                if (data_size != size)
+                  new_backlink_needed = true;
+              },
+              [&] (Snapper::Archive::Backlink::Error) {
+                new_backlink_needed = true;
+              });
+
+          if (new_backlink_needed)
+            return;
+
+          latest_valid_backlink->get_reference_count ().with_result (
+              [this, &entry, &new_backlink_needed,
+               &latest_valid_backlink] (Snapper::RC rc) {
+                if (rc >= config.redundancy)
+                  {
+                    if (config.verbose)
+                      Genode::log ("backlink reference count exceeded: ",
+                                   latest_valid_backlink->value,
+                                   ". Creating redundant copy.");
+
+                    new_backlink_needed = true;
+                  }
+                else
+                  {
+                    if (latest_valid_backlink
+                            ->write_reference_count (rc + 1, rc_writer)
+                            .failed ())
+                      {
+                        Genode::error ("failed to update reference count of "
+                                       "backlink! Creating a new backlink.");
+
+                        new_backlink_needed = true;
+                      }
+                    else if (!__written_now (*latest_valid_backlink))
+                      archiver->link (entry);
+                  }
+              },
+              [&new_backlink_needed] (Snapper::Archive::Backlink::Error) {
+                // INFO Technically, this code should not be reachable
+                // since we already checked that the backlink is valid.
+                new_backlink_needed = true;
+              });
+        },
+        [&] () { new_backlink_needed = true; });
+
+    return !new_backlink_needed;
+  }
+
+  bool
+  Main::__written_now (const Archive::Backlink &backlink)
+  {
+    // INFO The snapshot files of a generation live below its directory.
+    Genode::size_t len = generation_name.length () - 1;
+
+    return len && Genode::strcmp (backlink.value.string (),
+                                  generation_name.string (), len) == 0
+           && backlink.value.string ()[len] == '/';
+  }
+
+  Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+  Main::__next_backlink_name (void)
+  {
+    snapshot_files_created++;
+    snapshot_file_count++;
+
+    if (snapshot_file_count >= config.threshold)
+      {
+        snapshot->create_sub_directory ("ext");
+        if (!snapshot->directory_exists ("ext"))
+          {
+            Genode::error ("could not create extender sub-directory!");
+            throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+          }
+
+        /* INFO
+           `snapshot.construct()` will run the destructor first, hence
+           we need to copy the old snapshot directory.
+         */
+        Genode::Directory old_snapshot_dir(*snapshot, "/");
+        
+        snapshot.construct (old_snapshot_dir, "ext");
+        snapshot_dir_path = Genode::Directory::join (snapshot_dir_path, "ext");
+        snapshot_file_count = 0;
+      }
+
+    return Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN> (
+        Genode::Hex (snapshot_file_count));
+  }
+
+  Hash_id
+  Main::__hash_id (Genode::uint64_t size)
+  {
+    if (config.hash == Xxh32 && config.tree_threshold
+        && size >= config.tree_threshold)
+      return Tree_xxh32;
+
+    return config.hash;
+  }
+
+  Snapper::HASH
+  Main::__hash (void const *const payload, Genode::uint64_t size,
+                Snapper::VERSION &version, bool parallel)
+  {
+    Hash_id id = __hash_id (size);
+    version = version_byte (id);
+
+    if (id == Tree_xxh32 && parallel)
+      return tree_hash (payload, size, *pool, heap);
+
+    return hash_data (id, payload, size);
+  }
+
+  Snapper::HASH
+  Main::__copy_and_hash (void *dst, void const *const payload,
+                         Genode::uint64_t size, Snapper::VERSION &version)
+  {
+    Hash_id id = __hash_id (size);
+    version = version_byte (id);
+
+    if (id != Tree_xxh32)
+      return copy_and_hash (id, dst, payload, size);
+
+    Genode::memcpy (dst, payload, size);
+    return tree_hash (dst, size, *pool, heap);
+  }
+
+  void
+  Main::__write_backlink (void const *const payload, Genode::uint64_t size,
+                          Snapper::HASH hash, Archive::ArchiveKey identifier,
+                          Snapper::VERSION version)
+  {
+    // create a new snapshot file and write to it the payload metadata
+    // and the payload data
+
+    Genode::String<Vfs::Directory_service::Dirent::Name::MAX_LEN>
+        filepath_base = __next_backlink_name ();
+
+    Snapshot_header header (version, hash);
+
+    try
+      {
+        Genode::New_file file (*snapshot, filepath_base);
+
+        // INFO The payload is written straight from the caller's
+        // buffer, behind the header.
+        if (!append_gather (file, { { header.bytes, sizeof (header.bytes) },
+                                    { payload, (Genode::size_t)size } }))
+          {
+            Genode::error ("could not write to backlink file: ",
+                           filepath_base);
+            throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+          }
+      }
+    catch (Genode::New_file::Create_failed)
+      {
+        Genode::error ("could not create file: ", filepath_base);
+        throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+      }
+
+    // save the snapshot file's path (i.e. a backlink) into the archive
+    // (relative to snapper_root)
+
+    archiver->insert (identifier, Genode::Directory::join (snapshot_dir_path,
+                                                           filepath_base));
+  }
+
+  bool
+  Main::__stage (void const *const payload, Genode::uint64_t size,
+                 Archive::ArchiveKey identifier)
+  {
+    if (!staging || Staged::space (size) > config.write_behind)
+      return false;
+
+    // INFO Reclaims the staging area by writing all staged payloads.
+    if (Staged::space (size) > config.write_behind - staging_tail)
+      __flush_staged ();
+
+    if (staging_head == staging_tail)
+      Genode::Signal_transmitter (flush_handler).submit ();
+
+    Staged &staged = *reinterpret_cast<Staged *> (staging + staging_tail);
+    staged.identifier = identifier;
+    staged.size = size;
+    staged.hash = __copy_and_hash (staging + staging_tail + sizeof (Staged),
+                                   payload, size, staged.version);
+    staging_tail += Staged::space (size);
+
+    return true;
+  }
+
+  void
+  Main::__flush_staged (Genode::size_t max)
+  {
+    struct Pending
+    {
+      Archive::ArchiveKey identifier;
+      Genode::String<Vfs::MAX_PATH_LEN> path;
+      Snapshot_header header{};
+    };
+
+    while (max && staging_head != staging_tail)
+      {
+        Pending pending[Vfs_writer::MAX_FILES];
+        Genode::size_t num_pending = 0;
+
+        // INFO The new snapshot files of a batch are written
+        // concurrently. A key staged twice ends the batch, so the
+        // deduplication of its second payload sees the first one.
+        for (; max && staging_head != staging_tail
+               && num_pending < Vfs_writer::MAX_FILES;
+             max--)
+          {
+            Staged &staged
+                = *reinterpret_cast<Staged *> (staging + staging_head);
+            char const *payload = staging + staging_head + sizeof (Staged);
+
+            bool duplicate = false;
+            for (Genode::size_t i = 0; i < num_pending; i++)
+              duplicate |= pending[i].identifier == staged.identifier;
+
+            if (duplicate)
+              break;
+
+            staging_head += Staged::space (staged.size);
+
+            if (__reuse_backlink (staged.identifier, staged.hash, staged.size,
+                                  staged.version))
+              continue;
+
+            Pending &file = pending[num_pending];
+            file.identifier = staged.identifier;
+            file.path = Genode::Directory::join (snapshot_dir_path,
+                                                 __next_backlink_name ());
+
+            file.header = Snapshot_header (staged.version, staged.hash);
+
+            if (!writer.submit (Vfs_writer::Path ("/", file.path),
+                                file.header.bytes, sizeof (file.header.bytes),
+                                payload, staged.size))
+              {
+                Genode::error ("could not create file: ", file.path);
+                throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+              }
+
+            num_pending++;
+          }
+
+        if (!writer.wait ())
+          throw CrashStates::SNAPSHOT_NOT_POSSIBLE;
+
+        for (Genode::size_t i = 0; i < num_pending; i++)
+          archiver->insert (pending[i].identifier, pending[i].path);
+      }
+
+    if (staging_head == staging_tail)
+      staging_head = staging_tail = 0;
+  }
+
+  void
+  Main::__handle_flush (void)
+  {
+    if (state != Creation || flush_failed)
+      return;
+
+    // INFO A signal handler has no caller to report the failure to,
+    // hence it is reported by commit_snapshot().
+    try
+      {
+        __flush_staged (FLUSH_BATCH);
+      }
+    catch (CrashStates)
+      {
+        Genode::error ("could not write staged payloads!");
+        flush_failed = true;
+        staging_head = staging_tail = 0;
+        return;
+      }
+
+    if (staging_head != staging_tail)
+      Genode::Signal_transmitter (flush_handler).submit ();
+  }
+
+  void
+  Main::__drop_upload (void)
+  {
+    if (!upload.constructed ())
+      return;
+
+    Genode::String<Vfs::MAX_PATH_LEN> path = upload->path;
+
+    upload.destruct ();
+    snapper_root.unlink (path);
+  }
+
+  void
+  Main::__copy_backlink (Archive::Backlink &backlink,
+                         Archive::ArchiveKey identifier)
+  {
+    Genode::size_t size = 0;
+    backlink.get_data_size ().with_result (
+        [&] (Genode::size_t data_size) { size = data_size; },
+        [] (Archive::Backlink::Error) {});
+
+    Archive::Backlink::Error err = Archive::Backlink::Error::StatsErr;
+
+    buffers->with_buffer (size, [&] (Genode::Byte_range_ptr &data) {
+      if (size)
+        err = backlink.get_data (data);
+
+      if (err != Archive::Backlink::Error::None)
+        return;
+
+      // INFO The copy keeps the hash of the original.
+      Snapper::VERSION version = version_byte (Xxh32);
+      backlink.get_version ().with_result (
+          [&] (Snapper::VERSION ver) { version = ver; },
+          [] (Archive::Backlink::Error) {});
+
+      __write_backlink (data.start, size,
+                        payload_hash (version, data.start, size), identifier,
+                        version);
+    });
+
+    if (err != Archive::Backlink::Error::None)
+      {
+        Genode::error ("cannot copy snapshot file: ", backlink.value);
+        if (config.integrity)
+          throw CrashStates::INVALID_SNAPSHOT_FILE;
+      }
+  }
+
+  void
+  Main::__carry_forward (void)
+  {
+    Genode::uint64_t carried = 0;
+
+    archiver->for_each_entry ([&] (const Archive::ArchiveEntry &entry) {
+      if (entry.submitted == archiver->epoch || entry.queue.empty ())
+        return;
+
+      Archive::Backlink *latest = nullptr;
+      entry.queue.for_each (
+          [&] (Archive::Backlink &backlink) { latest = &backlink; });
+
+      bool copy_needed = false;
+
+      latest->get_reference_count ().with_result (
+          [&] (Snapper::RC rc) {
+            if (rc >= config.redundancy
+                || latest->write_reference_count (rc + 1, rc_writer)
+                       .failed ())
+              copy_needed = true;
+          },
+          [&] (Archive::Backlink::Error) {
+            Genode::error ("cannot carry forward snapshot file: ",
+                           latest->value);
+
+            if (config.integrity)
+              throw CrashStates::INVALID_SNAPSHOT_FILE;
+          });
+
+      // INFO The copy is appended to the queue of the entry, which may
+      // relocate the backlinks.
+      if (copy_needed)
+        __copy_backlink (*latest, entry.name);
+
+      carried++;
+    });
+
+    if (config.verbose)
+      Genode::log ("carried forward ", carried, " keys");
+  }
+
   void
   Main::__abort_snapshot (void)
   {
+    __drop_upload ();
+    staging_head = staging_tail = 0;
+    flush_failed = false;
+
     if (snapshot.constructed ())
       {
         snapshot->unlink ("/");
@@ -915,39 +2086,14 @@ namespace Snapper
         generation.destruct ();
       }
 
-    archiver.destruct ();
-  }
-
-  void
-  Main::__update_references (void)
-  {
-    bool success = false;
-
-    archiver->archive.for_each ([this, &success] (
-                                    const Archive::ArchiveEntry &entry) {
-      entry.queue.for_each ([this, &success] (Archive::Backlink &backlink) {
-        backlink.get_reference_count ().with_result (
-            [&backlink, &success] (Snapper::RC rc) {
-              if (backlink.set_reference_count (++rc).ok ())
-                {
-                  success = true;
-                }
-            },
-            [this] (Snapper::Archive::Backlink::Error) {
-              if (config.integrity)
-                {
-                  Genode::error ("invalid snapshot file");
-                  throw CrashStates::INVALID_SNAPSHOT_FILE;
-                }
-            });
-
-        if (success)
-          return;
-      });
+    // INFO The discarded changes are gone with the archiver, hence the
+    // next snapshot reloads the archive of the last committed generation.
+    if (archiver_gen != "")
+      basis_gen = archiver_gen;
 
-      if (success)
-        return;
-    });
+    archiver.destruct ();
+    archiver_gen = "";
+    delta_chain = 0;
   }
 
   Genode::uint64_t
@@ -957,7 +2103,7 @@ namespace Snapper
 
     snapper_root.for_each_entry (
         [this, &num_generations] (Genode::Directory::Entry &e) {
-          if (__valid_archive (Genode::Directory::join (e, "archive")))
+          if (__valid_gen (e.name ()))
             num_generations++;
         });
 
@@ -1044,15 +2190,21 @@ namespace Snapper
 
           // check each valid generation
           snapper_root.for_each_entry ([&] (Genode::Directory::Entry &gen) {
-            if (__valid_archive (
-                    Genode::Directory::join (gen.name (), "archive")))
+            Genode::String<Vfs::MAX_PATH_LEN> archive_path
+                = __archive_path (gen.name ());
+
+            if (archive_path != "")
               {
-                Genode::Directory gen_dir (snapper_root, gen.name ());
-                Genode::Readonly_file archive_file (gen_dir, "archive");
+                Genode::Readonly_file archive_file (snapper_root,
+                                                    archive_path);
+
+                bool delta = archive_path
+                             != Genode::Directory::join (gen.name (),
+                                                         "archive");
 
                 // check if backlink is present in a valid generation
                 if (Snapper::Archive::archive_file_contains_backlink (
-                        archive_file, entry_path))
+                        archive_file, entry_path, delta))
                   {
                     is_needed = true;
                   }
@@ -0,0 +1,37 @@
+#include "tree_hash.h"
+
+Genode::uint32_t
+Snapper::tree_hash (const void *input, Genode::uint64_t length)
+{
+  Tree_hasher hasher;
+  hasher.add (input, length);
+  return hasher.hash ();
+}
+
+Genode::uint32_t
+Snapper::tree_hash (const void *input, Genode::uint64_t length,
+                    Worker_pool &pool, Genode::Allocator &alloc)
+{
+  Genode::size_t leaves
+      = (Genode::size_t)((length + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE);
+
+  if (leaves < 2 || !pool.workers ())
+    return tree_hash (input, length);
+
+  Genode::uint32_t *digests
+      = (Genode::uint32_t *)alloc.alloc (leaves * sizeof (Genode::uint32_t));
+
+  pool.for_each_item (leaves, [&] (Genode::size_t leaf) {
+    Genode::uint64_t offset = (Genode::uint64_t)leaf * TREE_LEAF_SIZE;
+
+    digests[leaf] = xxhash32 ((const char *)input + offset,
+                              Genode::min ((Genode::uint64_t)TREE_LEAF_SIZE,
+                                           length - offset));
+  });
+
+  Genode::uint32_t hash
+      = xxhash32 (digests, leaves * sizeof (Genode::uint32_t));
+
+  alloc.free (digests, leaves * sizeof (Genode::uint32_t));
+  return hash;
+}
@@ -0,0 +1,259 @@
+#include <base/log.h>
+
+#include "vfs_writer.h"
+
+Snapper::Vfs_writer::~Vfs_writer ()
+{
+  for (File &file : _files)
+    if (file.handle)
+      _close (file, File::FREE);
+}
+
+bool
+Snapper::Vfs_writer::_open (File &file)
+{
+  using Open_result = Vfs::Directory_service::Open_result;
+
+  if (!file.truncate)
+    {
+      if (_root.open (file.path.string (),
+                      Vfs::Directory_service::OPEN_MODE_WRONLY, &file.handle,
+                      _alloc)
+          == Open_result::OPEN_OK)
+        return true;
+
+      file.handle = nullptr;
+      file.state = File::FAILED;
+      return false;
+    }
+
+  Open_result res = _root.open (
+      file.path.string (),
+      Vfs::Directory_service::OPEN_MODE_WRONLY
+          | Vfs::Directory_service::OPEN_MODE_CREATE,
+      &file.handle, _alloc);
+
+  // INFO Like Genode::New_file, an existing file is overwritten.
+  if (res == Open_result::OPEN_ERR_EXISTS)
+    {
+      res = _root.open (file.path.string (),
+                        Vfs::Directory_service::OPEN_MODE_WRONLY,
+                        &file.handle, _alloc);
+
+      if (res == Open_result::OPEN_OK
+          && _root.ftruncate (file.handle, 0)
+                 != Vfs::File_io_service::FTRUNCATE_OK)
+        {
+          _close (file, File::FAILED);
+          return false;
+        }
+    }
+
+  if (res != Open_result::OPEN_OK)
+    {
+      file.handle = nullptr;
+      file.state = File::FAILED;
+      return false;
+    }
+
+  return true;
+}
+
+void
+Snapper::Vfs_writer::_close (File &file, File::State state)
+{
+  if (file.handle)
+    file.handle->close ();
+
+  file.handle = nullptr;
+  file.state = state;
+}
+
+bool
+Snapper::Vfs_writer::_advance (File &file)
+{
+  using Write_result = Vfs::File_io_service::Write_result;
+  using Sync_result = Vfs::File_io_service::Sync_result;
+
+  bool progress = false;
+
+  while (file.state == File::WRITE)
+    {
+      if (file.range == file.num_ranges)
+        {
+          file.state = File::SYNC;
+          progress = true;
+          break;
+        }
+
+      Genode::size_t out_count = 0;
+      Genode::Const_byte_range_ptr src (file.start[file.range] + file.written,
+                                        file.size[file.range] - file.written);
+
+      file.handle->seek (file.offset);
+      Write_result res
+          = file.handle->fs ().write (file.handle, src, out_count);
+
+      if (res == Write_result::WRITE_ERR_WOULD_BLOCK)
+        return progress;
+
+      // INFO A write that succeeds without writing anything is not
+      // a would-block, waiting for I/O progress would never return.
+      // Retries once after the caller committed the I/O.
+      if (res == Write_result::WRITE_OK && !out_count && src.num_bytes)
+        {
+          if (file.stalled)
+            {
+              Genode::error ("no progress writing to file: ", file.path);
+              _close (file, File::FAILED);
+              return true;
+            }
+
+          file.stalled = true;
+          return true;
+        }
+
+      if (res != Write_result::WRITE_OK)
+        {
+          Genode::error ("could not write to file: ", file.path);
+          _close (file, File::FAILED);
+          return true;
+        }
+
+      file.stalled = false;
+      file.offset += out_count;
+      file.written += out_count;
+
+      if (file.written == file.size[file.range])
+        {
+          file.range++;
+          file.written = 0;
+        }
+
+      progress = true;
+    }
+
+  if (file.state == File::SYNC)
+    {
+      if (!file.sync_queued)
+        {
+          if (!file.handle->fs ().queue_sync (file.handle))
+            return progress;
+
+          file.sync_queued = true;
+          progress = true;
+        }
+
+      switch (file.handle->fs ().complete_sync (file.handle))
+        {
+        case Sync_result::SYNC_QUEUED:
+          break;
+
+        case Sync_result::SYNC_OK:
+          _close (file, File::DONE);
+          progress = true;
+          break;
+
+        default:
+          Genode::error ("could not sync file: ", file.path);
+          _close (file, File::FAILED);
+          progress = true;
+          break;
+        }
+    }
+
+  return progress;
+}
+
+bool
+Snapper::Vfs_writer::submit (const Path &path, char const *start0,
+                             Genode::size_t size0, char const *start1,
+                             Genode::size_t size1)
+{
+  return _submit (path, 0, true, start0, size0, start1, size1);
+}
+
+bool
+Snapper::Vfs_writer::submit_at (const Path &path, Vfs::file_size offset,
+                                char const *start, Genode::size_t size)
+{
+  return _submit (path, offset, false, start, size, nullptr, 0);
+}
+
+bool
+Snapper::Vfs_writer::_submit (const Path &path, Vfs::file_size offset,
+                              bool truncate, char const *start0,
+                              Genode::size_t size0, char const *start1,
+                              Genode::size_t size1)
+{
+  for (File &file : _files)
+    {
+      if (file.state != File::FREE)
+        continue;
+
+      file = File ();
+      file.path = path;
+      file.offset = offset;
+      file.truncate = truncate;
+      file.start[0] = start0;
+      file.size[0] = size0;
+      file.start[1] = start1;
+      file.size[1] = size1;
+      file.num_ranges = start1 ? 2 : 1;
+
+      if (!_open (file))
+        {
+          file.state = File::FREE;
+          return false;
+        }
+
+      file.state = File::WRITE;
+
+      // INFO Gets the write going without waiting for the other files.
+      if (_advance (file))
+        _io.commit ();
+
+      return true;
+    }
+
+  return false;
+}
+
+bool
+Snapper::Vfs_writer::wait (void)
+{
+  for (;;)
+    {
+      bool busy = false;
+      bool progress = false;
+
+      for (File &file : _files)
+        {
+          if (file.state != File::WRITE && file.state != File::SYNC)
+            continue;
+
+          progress |= _advance (file);
+          busy |= file.state == File::WRITE || file.state == File::SYNC;
+        }
+
+      if (!busy)
+        break;
+
+      if (progress)
+        _io.commit ();
+      else
+        _io.commit_and_wait ();
+    }
+
+  bool ok = true;
+
+  for (File &file : _files)
+    {
+      if (file.state == File::FAILED)
+        ok = false;
+
+      file.state = File::FREE;
+    }
+
+  return ok;
+}
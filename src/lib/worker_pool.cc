@@ -0,0 +1,104 @@
+#include <util/construct_at.h>
+
+#include "worker_pool.h"
+
+void
+Snapper::Worker_pool::Worker::entry ()
+{
+  for (;;)
+    {
+      pool._start.down ();
+
+      if (pool._exit)
+        return;
+
+      while (pool._process_next ())
+        ;
+
+      pool._done.up ();
+    }
+}
+
+Snapper::Worker_pool::Worker_pool (Genode::Env &env, Genode::Allocator &alloc,
+                                   unsigned workers)
+    : _alloc (alloc)
+{
+  if (!workers)
+    return;
+
+  _workers = (Worker **)_alloc.alloc (workers * sizeof (Worker *));
+
+  for (; _count < workers; _count++)
+    {
+      _workers[_count] = new (_alloc) Worker (env, *this);
+      _workers[_count]->start ();
+    }
+}
+
+Snapper::Worker_pool::~Worker_pool ()
+{
+  _exit = true;
+
+  for (unsigned i = 0; i < _count; i++)
+    _start.up ();
+
+  for (unsigned i = 0; i < _count; i++)
+    {
+      _workers[i]->join ();
+      Genode::destroy (_alloc, _workers[i]);
+    }
+
+  if (_workers)
+    _alloc.free (_workers, _count * sizeof (Worker *));
+}
+
+bool
+Snapper::Worker_pool::_process_next (void)
+{
+  Genode::size_t item;
+
+  {
+    Genode::Mutex::Guard guard (_mutex);
+
+    if (_next >= _items)
+      return false;
+
+    item = _next++;
+  }
+
+  _work->process (item);
+  return true;
+}
+
+void
+Snapper::Worker_pool::run (Work &work, Genode::size_t items)
+{
+  if (!items)
+    return;
+
+  {
+    Genode::Mutex::Guard guard (_mutex);
+
+    _work = &work;
+    _items = items;
+    _next = 0;
+  }
+
+  // INFO Waking more workers than there are items only costs a
+  // context switch each.
+  unsigned woken = (unsigned)Genode::min ((Genode::size_t)_count, items - 1);
+
+  for (unsigned i = 0; i < woken; i++)
+    _start.up ();
+
+  while (_process_next ())
+    ;
+
+  for (unsigned i = 0; i < woken; i++)
+    _done.down ();
+
+  Genode::Mutex::Guard guard (_mutex);
+
+  _work = nullptr;
+  _items = 0;
+}
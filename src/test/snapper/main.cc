@@ -1,8 +1,13 @@
+#include <base/attached_rom_dataspace.h>
 #include <base/component.h>
+#include <os/vfs.h>
 #include <util/construct_at.h>
 #include <util/list.h>
 
+#include "snapper_session/async_client.h"
 #include "snapper_session/connection.h"
+#include "snapper_session/hash_cache.h"
+#include "snapper_session/lazy_restore.h"
 #include "utils.h"
 
 /* Test Stats */
@@ -76,6 +81,350 @@ test_snapshot_creation (Snapper::Connection &snapper)
   TEST (true);
 }
 
+void
+test_batched_snapshot_creation (Snapper::Connection &snapper, Genode::Heap &heap)
+{
+  if (snapper.init_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  int *values = new (heap) int[TESTS];
+  Snapper::Take_request *requests = new (heap) Snapper::Take_request[TESTS];
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      values[i - 1] = i;
+      requests[i - 1] = { (Archive::ArchiveKey)i, &values[i - 1],
+                          sizeof (decltype (i)) };
+    }
+
+  bool ok = snapper.take_snapshots (requests, TESTS) == Snapper::Ok;
+
+  for (int i = 0; i < TESTS; i++)
+    {
+      if (requests[i].result != Snapper::Ok)
+        ok = false;
+    }
+
+  heap.free (requests, sizeof (Snapper::Take_request) * TESTS);
+  heap.free (values, sizeof (int) * TESTS);
+
+  if (snapper.commit_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  TEST (ok);
+}
+
+void
+test_parallel_batched_snapshot (Snapper::Connection &snapper,
+                                Genode::Heap &heap)
+{
+  // INFO The snapper hashes batches on its worker threads (see the
+  // `workers` attribute in run/snapper-common.inc). The keys follow
+  // the ones of the other tests, so their values do not interfere.
+  Archive::ArchiveKey base = 2 * TESTS;
+
+  if (snapper.init_snapshot () != Snapper::Ok)
+    TEST (false);
+
+  int *values = new (heap) int[TESTS];
+  Snapper::Take_request *requests = new (heap) Snapper::Take_request[TESTS];
+
+  for (int i = 0; i < TESTS; i++)
+    {
+      values[i] = 7 * i;
+      requests[i] = { base + i, &values[i], sizeof (int) };
+    }
+
+  bool ok = snapper.take_snapshots (requests, TESTS) == Snapper::Ok;
+
+  for (int i = 0; i < TESTS; i++)
+    if (requests[i].result != Snapper::Ok)
+      ok = false;
+
+  heap.free (requests, sizeof (Snapper::Take_request) * TESTS);
+  heap.free (values, sizeof (int) * TESTS);
+
+  if (snapper.commit_snapshot () != Snapper::Ok
+      || snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  for (int i = 0; i < TESTS; i++)
+    {
+      int value = -1;
+
+      if (snapper.restore (&value, sizeof (decltype (value)), base + i)
+              != Snapper::Ok
+          || value != 7 * i)
+        ok = false;
+    }
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_write_behind_snapshot (Snapper::Connection &snapper)
+{
+  // INFO The payloads are staged (see the `write_behind` attribute in
+  // run/snapper-common.inc) and must be on disk once the commit
+  // returns.
+  Archive::ArchiveKey base = 3 * TESTS;
+
+  if (snapper.init_snapshot () != Snapper::Ok)
+    TEST (false);
+
+  for (int i = 0; i < TESTS; i++)
+    {
+      int value = 11 * i;
+
+      if (snapper.take_snapshot (&value, sizeof (decltype (value)), base + i)
+          != Snapper::Ok)
+        TEST (false);
+    }
+
+  if (snapper.commit_snapshot () != Snapper::Ok
+      || snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  bool ok = true;
+
+  for (int i = 0; i < TESTS; i++)
+    {
+      int value = -1;
+
+      if (snapper.restore (&value, sizeof (decltype (value)), base + i)
+              != Snapper::Ok
+          || value != 11 * i)
+        ok = false;
+    }
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_async_snapshot_creation (Genode::Env &env, Snapper::Connection &snapper,
+                              Genode::Heap &heap)
+{
+  if (snapper.init_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  struct Wakeup
+  {
+    void handle (void) {}
+  } wakeup;
+
+  Genode::Io_signal_handler<Wakeup> handler (env.ep (), wakeup,
+                                             &Wakeup::handle);
+
+  Snapper::Async_client async (snapper, env.rm (), heap);
+  async.sigh (handler);
+
+  bool ok = true;
+
+  auto collect = [&] () {
+    async.for_each_completion ([&] (Archive::ArchiveKey, Snapper::Result res) {
+      if (res != Snapper::Ok)
+        ok = false;
+    });
+  };
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      while (!async.submit (&i, sizeof (decltype (i)), i))
+        {
+          collect ();
+          env.ep ().wait_and_dispatch_one_io_signal ();
+        }
+    }
+
+  // INFO All snapshots must be completed before committing.
+  while (async.pending ())
+    {
+      collect ();
+
+      if (async.pending ())
+        env.ep ().wait_and_dispatch_one_io_signal ();
+    }
+
+  if (snapper.commit_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  TEST (ok);
+}
+
+void
+test_region_snapshot_creation (Genode::Env &env, Snapper::Connection &snapper)
+{
+  if (snapper.init_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  Genode::Attached_ram_dataspace region (env.ram (), env.rm (),
+                                         TESTS * sizeof (int));
+
+  int *values = region.local_addr<int> ();
+  for (int i = 1; i <= TESTS; i++)
+    values[i - 1] = i;
+
+  if (snapper.attach_region (region.cap ()) != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  bool ok = true;
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      if (snapper.take_snapshot_region ((i - 1) * sizeof (int), sizeof (int),
+                                        i)
+          != Snapper::Ok)
+        ok = false;
+    }
+
+  (void)snapper.attach_region (Genode::Dataspace_capability ());
+
+  if (snapper.commit_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  TEST (ok);
+}
+
+void
+test_probed_snapshot_creation (Snapper::Connection &snapper)
+{
+  if (snapper.init_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      if (snapper.take_snapshot_probed (&i, sizeof (decltype (i)), i)
+          != Snapper::Ok)
+        {
+          TEST (false);
+        }
+    }
+
+  if (snapper.commit_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  TEST (true);
+}
+
+void
+test_cached_snapshot_creation (Snapper::Connection &snapper,
+                               Genode::Heap &heap)
+{
+  Snapper::Hash_cache cache (snapper, heap);
+
+  // INFO The first generation fills the cache, the second one only
+  // transfers the payloads of the dirty keys.
+  for (int gen = 0; gen < 2; gen++)
+    {
+      if (cache.init_snapshot () != Snapper::Ok)
+        {
+          TEST (false);
+        }
+
+      for (int i = 1; i <= TESTS; i++)
+        {
+          if (gen && i % 2)
+            cache.mark_dirty (i);
+
+          if (cache.take_snapshot_if_dirty (&i, sizeof (decltype (i)), i)
+              != Snapper::Ok)
+            {
+              TEST (false);
+            }
+        }
+
+      if (cache.commit_snapshot () != Snapper::Ok)
+        {
+          TEST (false);
+        }
+    }
+
+  // INFO The clean keys were skipped by the second generation and
+  // must have been carried forward by the server.
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  bool ok = true;
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      int value = 0;
+
+      if (snapper.restore (&value, sizeof (decltype (value)), i)
+              != Snapper::Ok
+          || value != i)
+        ok = false;
+    }
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_streamed_snapshot_creation (Snapper::Connection &snapper)
+{
+  if (snapper.init_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  // INFO Each payload is streamed byte by byte, the restored values
+  // must match the ones of a single take_snapshot().
+  for (int i = 1; i <= TESTS; i++)
+    {
+      if (snapper.begin_snapshot (i) != Snapper::Ok)
+        {
+          TEST (false);
+        }
+
+      for (Genode::size_t j = 0; j < sizeof (decltype (i)); j++)
+        {
+          if (snapper.append_snapshot ((char *)&i + j, 1) != Snapper::Ok)
+            {
+              TEST (false);
+            }
+        }
+
+      if (snapper.finish_snapshot () != Snapper::Ok)
+        {
+          TEST (false);
+        }
+    }
+
+  if (snapper.commit_snapshot () != Snapper::Ok)
+    {
+      TEST (false);
+    }
+
+  TEST (true);
+}
+
 void
 test_successful_recovery (Snapper::Connection &snapper)
 {
@@ -102,6 +451,178 @@ test_successful_recovery (Snapper::Connection &snapper)
   TEST (true);
 }
 
+void
+test_lazy_recovery (Snapper::Connection &snapper, Genode::Heap &heap)
+{
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  int *values = new (heap) int[TESTS];
+  for (int i = 0; i < TESTS; i++)
+    values[i] = 0;
+
+  bool ok;
+  {
+    Snapper::Lazy_restore lazy (snapper, heap);
+    lazy.add_range (1, TESTS, values, sizeof (int));
+
+    // INFO Touching the first key prefetches its successors as well.
+    ok = lazy.touch (1) == Snapper::Ok && values[0] == 1
+         && (TESTS < 2 || lazy.restored (2));
+
+    ok = lazy.restore_all () == Snapper::Ok && ok;
+  }
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      if (values[i - 1] != i)
+        ok = false;
+    }
+
+  heap.free (values, sizeof (int) * TESTS);
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_prefetched_recovery (Snapper::Connection &snapper)
+{
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  // INFO read_ahead is set in run/snapper-common.inc, so the keys
+  // must be prefetched.
+  bool ok = snapper.prefetch (1, TESTS) == Snapper::Ok;
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      int value = 0;
+
+      if (snapper.restore (&value, sizeof (decltype (value)), i)
+              != Snapper::Ok
+          || value != i)
+        ok = false;
+    }
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_ranged_recovery (Snapper::Connection &snapper)
+{
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  bool ok = true;
+
+  // INFO Restores each value in two halves, the second range of a key
+  // is read without verifying the data again.
+  for (int i = 1; i <= TESTS; i++)
+    {
+      int value = 0;
+      Genode::size_t half = sizeof (decltype (value)) / 2;
+
+      if (snapper.restore_range (&value, 0, half, i) != Snapper::Ok
+          || snapper.restore_range ((char *)&value + half, half, half, i)
+                 != Snapper::Ok
+          || value != i)
+        ok = false;
+    }
+
+  int value = 0;
+  if (snapper.restore_range (&value, 1, sizeof (decltype (value)), 1)
+      != Snapper::NoData)
+    ok = false;
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_batched_recovery (Snapper::Connection &snapper, Genode::Heap &heap)
+{
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  int *values = new (heap) int[TESTS];
+  Snapper::Restore_request *requests
+      = new (heap) Snapper::Restore_request[TESTS];
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      values[i - 1] = 0;
+      requests[i - 1] = { (Archive::ArchiveKey)i, &values[i - 1],
+                          sizeof (decltype (i)) };
+    }
+
+  bool ok = snapper.restore_batch (requests, TESTS) == Snapper::Ok;
+
+  for (int i = 1; i <= TESTS; i++)
+    {
+      if (requests[i - 1].result != Snapper::Ok || values[i - 1] != i
+          || requests[i - 1].size != sizeof (decltype (i)))
+        ok = false;
+    }
+
+  heap.free (requests, sizeof (Snapper::Restore_request) * TESTS);
+  heap.free (values, sizeof (int) * TESTS);
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
+void
+test_generation_basis (Snapper::Connection &snapper)
+{
+  // INFO A key taken only in the middle generation must survive the
+  // next snapshot, which builds on the committed generation instead of
+  // the one opened before it.
+  Archive::ArchiveKey middle_key = TESTS + 1;
+  int middle = TESTS + 1;
+
+  if (snapper.open_generation () != Snapper::Ok
+      || snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  if (snapper.init_snapshot () != Snapper::Ok
+      || snapper.take_snapshot (&middle, sizeof (decltype (middle)),
+                                middle_key)
+             != Snapper::Ok
+      || snapper.commit_snapshot () != Snapper::Ok)
+    TEST (false);
+
+  int first = 1;
+
+  if (snapper.init_snapshot () != Snapper::Ok
+      || snapper.take_snapshot (&first, sizeof (decltype (first)), 1)
+             != Snapper::Ok
+      || snapper.commit_snapshot () != Snapper::Ok)
+    TEST (false);
+
+  if (snapper.open_generation () != Snapper::Ok)
+    TEST (false);
+
+  int value = 0;
+  bool ok = snapper.restore (&value, sizeof (decltype (value)), middle_key)
+                == Snapper::Ok
+            && value == middle;
+
+  if (snapper.close_generation () != Snapper::Ok)
+    TEST (false);
+
+  TEST (ok);
+}
+
 void
 test_snapshot_purge (Snapper::Connection &snapper)
 {
@@ -118,19 +639,86 @@ test_snapshot_purge_zombies (Snapper::Connection &snapper)
   TEST (ok);
 }
 
+static unsigned
+count_files (Genode::Directory &root, const Genode::Directory::Path &dir)
+{
+  unsigned files = 0;
+
+  Genode::Directory (root, dir).for_each_entry (
+      [&] (Genode::Directory::Entry &entry) {
+        if (entry.name ().string ()[0] == '.')
+          return;
+
+        Genode::Directory::Path path
+            = Genode::Directory::join (dir, entry.name ());
+
+        if (root.directory_exists (path))
+          files += count_files (root, path);
+        else
+          files++;
+      });
+
+  return files;
+}
+
+void
+test_discarded_snapshot_purge (Genode::Env &env, Snapper::Connection &snapper,
+                               Genode::Heap &heap)
+{
+  // INFO Neither the snapshot file written for the fresh key nor the
+  // reference added to the snapshot file of key 1 may outlive the
+  // discard, hence no file remains once all generations are purged.
+  int reused = 1;
+  int fresh = 4 * TESTS;
+
+  if (snapper.init_snapshot () != Snapper::Ok
+      || snapper.take_snapshot (&reused, sizeof (decltype (reused)), 1)
+             != Snapper::Ok
+      || snapper.take_snapshot (&fresh, sizeof (decltype (fresh)),
+                                (Archive::ArchiveKey)fresh)
+             != Snapper::Ok
+      || snapper.discard (1) != Snapper::Ok
+      || snapper.discard ((Archive::ArchiveKey)fresh) != Snapper::Ok
+      || snapper.commit_snapshot () != Snapper::Ok)
+    TEST (false);
+
+  while (snapper.purge () == Snapper::Ok)
+    ;
+
+  Genode::Attached_rom_dataspace config (env, "config");
+  Genode::Root_directory root (env, heap, config.xml ().sub_node ("vfs"));
+
+  TEST (count_files (root, "/") == 0);
+}
+
 void
 Component::construct (Genode::Env &env)
 {
   Snapper::Connection snapper (env);
+  Genode::Heap heap{ env.ram (), env.rm () };
 
   Genode::log ("-*- SNAPPER TEST SUITE -*-\n");
 
   test_snapshot_creation (snapper);
   test_snapshot_creation (snapper); // test linking with identical snapshot
+  test_batched_snapshot_creation (snapper, heap);
+  test_parallel_batched_snapshot (snapper, heap);
+  test_write_behind_snapshot (snapper);
+  test_async_snapshot_creation (env, snapper, heap);
+  test_region_snapshot_creation (env, snapper);
+  test_probed_snapshot_creation (snapper);
+  test_cached_snapshot_creation (snapper, heap);
+  test_streamed_snapshot_creation (snapper);
   test_successful_recovery (snapper);
+  test_batched_recovery (snapper, heap);
+  test_ranged_recovery (snapper);
+  test_prefetched_recovery (snapper);
+  test_lazy_recovery (snapper, heap);
+  test_generation_basis (snapper);
   test_snapshot_purge (snapper);
   test_snapshot_purge_zombies (snapper);
   test_snapshot_purge (snapper);
+  test_discarded_snapshot_purge (env, snapper, heap);
 
   summary ();
   Genode::log ("\n-*- SNAPPER TESTS DONE -*-");